@@ -1,9 +1,15 @@
 #include <assert.h>
 #include <errno.h>
 #include <float.h>
+#include <limits.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -11,7 +17,9 @@
 #include "fsecs.h"
 #include "memlib.h"
 #include "mm.h"
+#include "mmcache.h"
 #include "mminline.h"
+#include "mmlock.h"
 
 /**********************
  * Constants and macros
@@ -21,6 +29,9 @@
 #define MAXLINE 1024       /* max string size */
 #define MAX_REPL_SIZE 1024 /* max string size */
 #define HDRLINES 4         /* number of header lines in a trace file */
+#define THREAD_REPS 3      /* timed runs per thread count in -T mode */
+#define MAINT_WAKES 4      /* maintenance wakeups per -M idle period */
+#define PAGES_REPS 10      /* timed replays per trace and page kind (-L) */
 #define LINENUM(i)                                            \
     (i + 5) /* cnvt trace request nums to linenums (origin 1) \
              */
@@ -44,6 +55,8 @@ typedef struct {
     enum { ALLOC, FREE, REALLOC } type; /* type of request */
     int index;                          /* index for free() to use later */
     int size;                           /* byte size of alloc/realloc request */
+    int thread; /* issuing thread, 0 unless the trace says otherwise */
+    int after;  /* with a ^ marker, the op this one waits for, else -1 */
 } traceop_t;
 
 /* Holds the information for one trace file*/
@@ -53,6 +66,7 @@ typedef struct {
     int num_ids;         /* number of alloc/realloc ids */
     int num_ops;         /* number of distinct requests */
     int weight;          /* weight for this trace (unused) */
+    int num_threads;     /* threads issuing the requests (1 + largest id) */
     traceop_t *ops;      /* array of requests */
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     long *block_sizes; /* ... and a corresponding array of payload sizes */
@@ -68,6 +82,49 @@ typedef struct {
     range_t *ranges;
 } speed_t;
 
+/* The checkpoint a -W timed run starts from */
+typedef struct {
+    trace_t *trace;        /* the trace being timed ... */
+    int first;             /* ... from this op on */
+    mm_checkpoint_t *ckpt; /* the default heap after the ops before it */
+    char **blocks;         /* the trace's blocks at that point */
+} warm_t;
+
+/* One thread's share of a multi-threaded replay (-T) */
+typedef struct {
+    trace_t **traces;         /* the traces to replay ... */
+    int num_traces;           /* ... all of them, one after the other, */
+    int first;                /* ... starting with this one */
+    int part, num_parts;      /* only ids in the part-th of num_parts ranges */
+    char **blocks;            /* this thread's payload pointer for each id */
+    long *block_sizes;        /* ... and the payload size it asked for */
+    int errors;               /* failed calls and overwritten payloads */
+    struct timespec t0, t1;   /* when the thread started and finished */
+    mm_heap_t *heap;          /* the heap shared by all threads */
+    pthread_barrier_t *start; /* released once every thread is ready */
+    long *lat;                /* if not NULL, where each op's ns go */
+} thread_work_t;
+
+/* One thread of a multi-threaded trace replay (-P) */
+typedef struct {
+    trace_t *trace;           /* the trace, whose blocks all threads share */
+    int thread;               /* replays the ops of this trace thread only */
+    char *done;               /* set for each op of the trace once it is done */
+    int errors;               /* failed calls and overwritten payloads */
+    struct timespec t0, t1;   /* when the thread started and finished */
+    mm_heap_t *heap;          /* the heap shared by all threads */
+    pthread_barrier_t *start; /* released once every thread is ready */
+} trace_thread_t;
+
+/* What one multi-threaded replay measured */
+typedef struct {
+    double secs;    /* from the first thread starting to the last finishing */
+    double ops;     /* ops replayed by all threads together */
+    long heap_size; /* heap size when the threads were done */
+    long passes;    /* passes of the heap's maintenance thread */
+    int errors;     /* failed calls and overwritten payloads */
+} replay_stats_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* defined for both libc malloc and student malloc package (mm.c) */
@@ -93,6 +150,24 @@ int verbose = 0;         /* global flag for verbose output */
 static int errors = 0;   /* number of errs found when running student malloc */
 char msg[MAXLINE + 100]; /* for whenever we need to compose an error message */
 
+/* -M: microseconds each -T replay thread idles after every trace */
+static long idle_us = 0;
+
+/* -W: the percentage of each trace that is run once, untimed, first */
+static int warm_percent = 0;
+
+/* -H: the most bytes a simulated heap may grow to */
+static long max_heap = MAX_HEAP;
+
+/* -C: the file the heap growth timeline is written to, or NULL */
+static char *growth_csv = NULL;
+
+/* -k: whether the -K replay feeds payload writes to the cache simulator */
+static int cache_payloads = 0;
+
+/* -u: whether the -U replay is checked against a run of eval_mm_util */
+static int sim_check = 0;
+
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
 
@@ -122,6 +197,15 @@ static void eval_libc_speed(void *ptr);
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
 static void eval_mm_speed(void *ptr);
+static double eval_mm_warm(trace_t *trace, double *ops);
+static void eval_mm_threads(char **tracefiles, int num_tracefiles,
+                            int max_threads);
+static void eval_mm_traced_threads(char **tracefiles, int num_tracefiles);
+static void eval_mm_pages(char **tracefiles, int num_tracefiles, int pages);
+static void eval_mm_rss(char **tracefiles, int num_tracefiles);
+static void eval_mm_growth(char **tracefiles, int num_tracefiles);
+static void eval_mm_cache(char **tracefiles, int num_tracefiles);
+static void eval_mm_sim(char **tracefiles, int num_tracefiles);
 
 /* Various helper routines */
 static double compute_performance_index(int num_tracefiles, double secs,
@@ -129,6 +213,8 @@ static double compute_performance_index(int num_tracefiles, double secs,
 static void printresults(int n, stats_t *stats);
 static void printpassed(int n, stats_t *stats);
 static void printresultsgradescope(int n, stats_t *stats);
+static long parse_size(const char *arg);
+static int parse_cache(char *arg);
 
 static void usage(void);
 static void unix_error(char *msg);
@@ -150,10 +236,20 @@ int main(int argc, char **argv) {
     range_t *ranges = NULL;     /* keeps track of block extents for one trace */
     stats_t *libc_stats = NULL; /* libc stats for each trace */
     speed_t speed_params;       /* input parameters to the xx_speed routines */
+    FILE *policy_log = NULL;    /* collects policy switches under -V */
+    char *policy_text = NULL;   /* ... and the text it collected */
+    size_t policy_len;
 
     int run_libc = 0;   /* If set, run libc malloc (set by -l) */
     int autograder = 0; /* If set, emit summary info for autograder (-g) */
     int gradescope = 0;
+    int threads = 0; /* If set, replay on up to this many threads (-T) */
+    int traced = 0;  /* If set, replay on the threads of the traces (-P) */
+    int pages = 0;   /* If set, compare small and these huge pages (-L) */
+    int rss = 0;     /* If set, report the heaps' resident memory (-R) */
+    int growth = 0;  /* If set, report how the heaps grew (-S, -C) */
+    int cache = 0;   /* If set, simulate the cache behaviour (-K) */
+    int sim = 0;     /* If set, measure the layout alone (-U) */
     /* temporaries used to compute the performance index */
     double secs, ops, util, perfindex;
     int numcorrect;
@@ -162,7 +258,8 @@ int main(int argc, char **argv) {
      * Read and interpret the command line arguments
      */
 
-    while ((c = getopt(argc, argv, "f:t:hvVgGalr")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:T:M:H:L:W:C:K:PRSUkuhvVgGalr")) !=
+           EOF) {
         switch (c) {
             case 'r': /* start repl */
                 driver();
@@ -190,6 +287,75 @@ int main(int argc, char **argv) {
                 if (tracedir[strlen(tracedir) - 1] != '/')
                     strcat(tracedir, "/"); /* path always ends with "/" */
                 break;
+            case 'T': /* Replay the traces on 1 to <threads> threads */
+                threads = atoi(optarg);
+                if (threads < 1) {
+                    usage();
+                    exit(1);
+                }
+                break;
+            case 'P': /* Replay each trace on the threads it names */
+                traced = 1;
+                break;
+            case 'M': /* Idle between traces in -T mode, see eval_mm_threads */
+                idle_us = atol(optarg);
+                if (idle_us < MAINT_WAKES) {
+                    usage();
+                    exit(1);
+                }
+                break;
+            case 'H': /* Let simulated heaps grow to this many bytes */
+                if ((max_heap = parse_size(optarg)) <= 0) {
+                    usage();
+                    exit(1);
+                }
+                break;
+            case 'L': /* Compare small pages against huge ones */
+                if (!strcmp(optarg, "thp")) {
+                    pages = MEM_PAGES_THP;
+                } else if (!strcmp(optarg, "hugetlb")) {
+                    pages = MEM_PAGES_HUGETLB;
+                }
+                if (pages == 0 || mem_set_pages(pages) < 0) {
+                    usage();
+                    exit(1);
+                }
+                mem_set_pages(MEM_PAGES_SMALL);
+                break;
+            case 'W': /* Time only what follows a warm-up, see eval_mm_warm */
+                warm_percent = atoi(optarg);
+                if (warm_percent < 1 || warm_percent > 99) {
+                    usage();
+                    exit(1);
+                }
+                break;
+            case 'R': /* Report resident memory next to the heap size */
+                rss = 1;
+                break;
+            case 'S': /* Summarize how the heap grew, see eval_mm_growth */
+                growth = 1;
+                break;
+            case 'C': /* ... and write every change in its size to a file */
+                growth = 1;
+                growth_csv = strdup(optarg);
+                break;
+            case 'K': /* Simulate the caches, see eval_mm_cache */
+                if (parse_cache(optarg) < 0) {
+                    usage();
+                    exit(1);
+                }
+                cache = 1;
+                break;
+            case 'k': /* ... with the payload writes as well */
+                cache_payloads = 1;
+                break;
+            case 'U': /* Measure the layout without payloads, see eval_mm_sim */
+                sim = 1;
+                break;
+            case 'u': /* ... and check it against the usual measurement */
+                sim = 1;
+                sim_check = 1;
+                break;
             case 'l': /* Run libc malloc */
                 run_libc = 1;
                 break;
@@ -220,7 +386,40 @@ int main(int argc, char **argv) {
         }
     }
 
-    /* Initialize the timing package */
+    /* The multi-threaded replay replaces the usual evaluation */
+    if (threads) {
+        eval_mm_threads(tracefiles, num_tracefiles, threads);
+        exit(errors != 0);
+    }
+    if (traced) {
+        eval_mm_traced_threads(tracefiles, num_tracefiles);
+        exit(errors != 0);
+    }
+    if (pages) {
+        eval_mm_pages(tracefiles, num_tracefiles, pages);
+        exit(errors != 0);
+    }
+    if (rss) {
+        eval_mm_rss(tracefiles, num_tracefiles);
+        exit(errors != 0);
+    }
+    if (growth) {
+        eval_mm_growth(tracefiles, num_tracefiles);
+        exit(errors != 0);
+    }
+    if (cache) {
+        eval_mm_cache(tracefiles, num_tracefiles);
+        exit(errors != 0);
+    }
+    if (sim) {
+        eval_mm_sim(tracefiles, num_tracefiles);
+        exit(errors != 0);
+    }
+
+    /*
+     * Initialize the timing package. The modes above keep their own time,
+     * so it is only announced for the runs that use it.
+     */
     init_fsecs();
 
     /*
@@ -264,7 +463,7 @@ int main(int argc, char **argv) {
     if (mm_stats == NULL) unix_error("mm_stats calloc in main failed");
 
     /* Initialize the simulated memory system in memlib.c */
-    mem_init();
+    mem_init_size(max_heap);
 
     /* Evaluate student's mm malloc package using the K-best scheme */
     for (i = 0; i < num_tracefiles; i++) {
@@ -272,14 +471,31 @@ int main(int argc, char **argv) {
         strncpy(mm_stats[i].trace_name, trace->trace_name, MAXLINE);
         mm_stats[i].ops = trace->num_ops;
         if (verbose > 1) printf("Checking mm_malloc for correctness, ");
+        /* Collect allocation policy switches during the checked run, to
+         * report them once the progress line is done */
+        if (verbose > 1) {
+            policy_log = open_memstream(&policy_text, &policy_len);
+            mm_set_log(policy_log);
+        }
         mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
+        mm_set_log(NULL);
+        if (policy_log != NULL) fclose(policy_log);
         if (mm_stats[i].valid) {
             if (verbose > 1) printf("efficiency, ");
             mm_stats[i].util = eval_mm_util(trace, i, &ranges);
             speed_params.trace = trace;
             speed_params.ranges = ranges;
             if (verbose > 1) printf("and performance.\n");
-            mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+            if (warm_percent) {
+                mm_stats[i].secs = eval_mm_warm(trace, &mm_stats[i].ops);
+            } else {
+                mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+            }
+        }
+        if (policy_log != NULL) {
+            fputs(policy_text, stdout);
+            free(policy_text);
+            policy_log = NULL;
         }
         free_trace(trace);
     }
@@ -361,9 +577,8 @@ static int add_range(range_t **ranges, char *lo, int size, int tracenum,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap, or one segment */
+    if (!mem_in_heap(lo, hi)) {
         sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)", lo, hi,
                 mem_heap_lo(), mem_heap_hi());
         malloc_error(tracenum, opnum, msg);
@@ -435,7 +650,10 @@ void _check(int errcode) {
  *********************************************/
 
 /*
- * read_trace - read a trace file and store it in memory
+ * read_trace - read a trace file and store it in memory. A request line
+ *    may start with the id of the thread that issues it (see
+ *    traces/README); a request on a block that another thread touched
+ *    last must carry a ^ marker, and then waits for that thread's request.
  */
 static trace_t *read_trace(char *tracedir, char *filename) {
     FILE *tracefile;
@@ -445,6 +663,7 @@ static trace_t *read_trace(char *tracedir, char *filename) {
     unsigned index, size;
     unsigned max_index = 0;
     unsigned op_index;
+    int *last_op; /* the latest op on each id, or -1 */
 
     if (verbose > 1) printf("Reading tracefile: %s\n", filename);
 
@@ -480,10 +699,25 @@ static trace_t *read_trace(char *tracedir, char *filename) {
              (long *)malloc(trace->num_ids * sizeof(long))) == NULL)
         unix_error("malloc 4 failed in read_trace");
 
+    if ((last_op = (int *)malloc(trace->num_ids * sizeof(int))) == NULL)
+        unix_error("malloc 5 failed in read_trace");
+    for (int id = 0; id < trace->num_ids; id++) last_op[id] = -1;
+
     /* read every request line in the trace file */
     index = 0;
     op_index = 0;
+    trace->num_threads = 1;
     while (fscanf(tracefile, "%s", type) != EOF) {
+        int thread = 0;
+        if (type[0] >= '0' && type[0] <= '9') {
+            thread = atoi(type);
+            _check(fscanf(tracefile, "%s", type));
+        }
+        if ((int)op_index >= trace->num_ops) {
+            printf("More than %d requests in tracefile %s\n", trace->num_ops,
+                   path);
+            exit(1);
+        }
         switch (type[0]) {
             case 'a':
                 _check(fscanf(tracefile, "%u %u", &index, &size));
@@ -509,9 +743,27 @@ static trace_t *read_trace(char *tracedir, char *filename) {
                        path);
                 exit(1);
         }
+        if ((int)index >= trace->num_ids) {
+            printf("Request %u uses id %u of %d in tracefile %s\n", op_index,
+                   index, trace->num_ids, path);
+            exit(1);
+        }
+        /* a request on another thread's block must say it waits for it */
+        int prev = last_op[index];
+        int cross = prev >= 0 && trace->ops[prev].thread != thread;
+        if (cross != (type[1] == '^')) {
+            printf("Request %u %s ^ marker in tracefile %s\n", op_index,
+                   cross ? "needs a" : "has a needless", path);
+            exit(1);
+        }
+        trace->ops[op_index].thread = thread;
+        trace->ops[op_index].after = cross ? prev : -1;
+        last_op[index] = op_index;
+        if (thread >= trace->num_threads) trace->num_threads = thread + 1;
         op_index++;
     }
     fclose(tracefile);
+    free(last_op);
     assert((int)max_index == trace->num_ids - 1);
     assert((int)op_index == trace->num_ops);
 
@@ -619,7 +871,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) {
                 oldsize = trace->block_sizes[index];
                 if (size < oldsize) oldsize = size;
                 for (j = 0; j < oldsize; j++) {
-                    if (newp[j] != (index & 0xFF)) {
+                    if (newp[j] != (char)(index & 0xFF)) {
                         malloc_error(tracenum, i,
                                      "mm_realloc did not preserve the "
                                      "data from old block");
@@ -655,10 +907,9 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) {
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   largest size the heap reached while running the student's malloc
+ *   package on the trace. Trimming and unmapping segments can shrink
+ *   the heap again, so its size at the end may be smaller.
  *
  */
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges) {
@@ -668,8 +919,8 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges) {
     int i;
     int index;
     int size, newsize, oldsize;
-    int max_total_size = 0;
-    int total_size = 0;
+    long max_total_size = 0;
+    long total_size = 0;
     char *p;
     char *newp, *oldp;
 
@@ -765,24 +1016,19 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges) {
         }
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    return ((double)max_total_size / (double)mem_heap_peak());
 }
 
 /*
- * eval_mm_speed - This is the function that is used by fcyc()
- *    to measure the running time of the mm malloc package.
+ * replay_speed - Runs ops first to last - 1 of a trace on the default heap,
+ *    without the checks of eval_mm_valid
  */
-static void eval_mm_speed(void *ptr) {
+static void replay_speed(trace_t *trace, int first, int last) {
     int i, index, size, newsize;
     char *p, *newp, *oldp, *block;
-    trace_t *trace = ((speed_t *)ptr)->trace;
-
-    /* Reset the heap and initialize the mm package */
-    mem_reset_brk();
-    if (mm_init() < 0) app_error("mm_init failed in eval_mm_speed");
 
     /* Interpret each trace request */
-    for (i = 0; i < trace->num_ops; i++) {
+    for (i = first; i < last; i++) {
         index = trace->ops[i].index;
         size = trace->ops[i].size;
         switch (trace->ops[i].type) {
@@ -817,6 +1063,1018 @@ static void eval_mm_speed(void *ptr) {
     }
 }
 
+/*
+ * eval_mm_speed - This is the function that is used by fcyc()
+ *    to measure the running time of the mm malloc package.
+ */
+static void eval_mm_speed(void *ptr) {
+    trace_t *trace = ((speed_t *)ptr)->trace;
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (mm_init() < 0) app_error("mm_init failed in eval_mm_speed");
+    replay_speed(trace, 0, trace->num_ops);
+}
+
+/*
+ * warm_restore - Sets the default heap, and the blocks of the trace, back
+ *    to the checkpoint taken by warm_up. Timed on its own, so that its cost
+ *    can be taken out of eval_mm_warm_speed's.
+ */
+static void warm_restore(void *ptr) {
+    warm_t *warm = ptr;
+
+    if (mm_restore(warm->ckpt) < 0) app_error("mm_restore failed");
+    memcpy(warm->trace->blocks, warm->blocks,
+           warm->trace->num_ids * sizeof(char *));
+}
+
+/*
+ * eval_mm_warm_speed - The function timed by fsecs with -W: starts from the
+ *    checkpoint rather than an empty heap, and runs only the ops after it
+ */
+static void eval_mm_warm_speed(void *ptr) {
+    warm_t *warm = ptr;
+
+    warm_restore(warm);
+    replay_speed(warm->trace, warm->first, warm->trace->num_ops);
+}
+
+/*
+ * warm_up - Runs the ops of the trace that come before the first timed one
+ *    (-W) on an empty default heap, once, and checkpoints the heap and the
+ *    trace's blocks for eval_mm_warm_speed
+ */
+static void warm_up(warm_t *warm, trace_t *trace, int first) {
+    warm->trace = trace;
+    warm->first = first;
+    mem_reset_brk();
+    if (mm_init() < 0) app_error("mm_init failed in warm_up");
+    replay_speed(trace, 0, first);
+    if ((warm->ckpt = mm_checkpoint()) == NULL ||
+        (warm->blocks = malloc(trace->num_ids * sizeof(char *))) == NULL) {
+        unix_error("warm_up: no memory for the checkpoint");
+    }
+    memcpy(warm->blocks, trace->blocks, trace->num_ids * sizeof(char *));
+}
+
+/*
+ * eval_mm_warm - Returns the seconds eval_mm_speed takes for the ops of a
+ *    trace from the warm_percent-th percent on (-W), warming the heap up
+ *    once instead of on every timed run. Also stores the number of timed
+ *    ops in ops.
+ */
+static double eval_mm_warm(trace_t *trace, double *ops) {
+    int first = (int)((long)trace->num_ops * warm_percent / 100);
+    warm_t warm;
+    double secs;
+
+    warm_up(&warm, trace, first);
+    secs = fsecs(eval_mm_warm_speed, &warm) - fsecs(warm_restore, &warm);
+    mm_checkpoint_free(warm.ckpt);
+    free(warm.blocks);
+    *ops = trace->num_ops - first;
+    /* the difference of two timings can come out below zero */
+    return secs > 0 ? secs : 1e-9;
+}
+
+/*
+ * in_part - Returns whether the ops on an id belong to the part-th of
+ *    num_parts contiguous id ranges of a trace
+ */
+static int in_part(trace_t *trace, int index, int part, int num_parts) {
+    return (long)index * num_parts / trace->num_ids == part;
+}
+
+/* Returns the seconds from a to b */
+static double elapsed(struct timespec *a, struct timespec *b) {
+    return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+/*
+ * replay_thread - The body of one -T replay thread: waits for the others,
+ *    then replays its traces through mm_heap_malloc, mm_heap_realloc and
+ *    mm_heap_free.
+ *    Every payload is filled with its id, and checked at both ends before
+ *    it is reallocated or freed, so blocks handed to two threads at once
+ *    show up as errors. Blocks a trace leaves allocated are freed before
+ *    the next one starts, and then the thread idles for idle_us (-M).
+ *    With work->lat set, the latency of every op is recorded there.
+ */
+static void *replay_thread(void *ptr) {
+    thread_work_t *work = ptr;
+
+    pthread_barrier_wait(work->start);
+    clock_gettime(CLOCK_MONOTONIC, &work->t0);
+    for (int t = 0; t < work->num_traces; t++) {
+        trace_t *trace = work->traces[(work->first + t) % work->num_traces];
+
+        for (int i = 0; i < trace->num_ops; i++) {
+            traceop_t *op = &trace->ops[i];
+            int index = op->index;
+            char *p = work->blocks[index];
+            long old_size = work->block_sizes[index];
+
+            struct timespec op_t0, op_t1;
+
+            if (!in_part(trace, index, work->part, work->num_parts)) continue;
+            if (op->type != ALLOC && p != NULL && old_size > 0 &&
+                (p[0] != (char)(index & 0xFF) ||
+                 p[old_size - 1] != (char)(index & 0xFF))) {
+                work->errors++;
+            }
+            if (work->lat != NULL) clock_gettime(CLOCK_MONOTONIC, &op_t0);
+            switch (op->type) {
+                case ALLOC:
+                    p = mm_heap_malloc(work->heap, op->size);
+                    break;
+                case REALLOC:
+                    p = mm_heap_realloc(work->heap, p, op->size);
+                    break;
+                case FREE:
+                    mm_heap_free(work->heap, p);
+                    p = NULL;
+                    break;
+            }
+            if (work->lat != NULL) {
+                clock_gettime(CLOCK_MONOTONIC, &op_t1);
+                *work->lat++ = (long)(elapsed(&op_t0, &op_t1) * 1e9);
+            }
+            if (op->type != FREE &&
+                ((p == NULL && op->size > 0) || !IS_ALIGNED(p))) {
+                work->errors++;
+                p = NULL;
+            }
+            if (p != NULL) memset(p, index & 0xFF, op->size);
+            work->blocks[index] = p;
+            work->block_sizes[index] = (p == NULL) ? 0 : op->size;
+        }
+        for (int id = 0; id < trace->num_ids; id++) {
+            mm_heap_free(work->heap, work->blocks[id]);
+            work->blocks[id] = NULL;
+            work->block_sizes[id] = 0;
+        }
+        if (idle_us > 0) {
+            struct timespec idle = {idle_us / 1000000,
+                                    idle_us % 1000000 * 1000};
+            nanosleep(&idle, NULL);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &work->t1);
+    return NULL;
+}
+
+/*
+ * replay_threads - Runs num_threads replay threads concurrently on one
+ *    heap in mem, which is reset first, and stores what they did in
+ *    *stats. With several traces, every thread replays all of them, thread
+ *    k starting with trace k; with a single trace, the ids are split into
+ *    num_threads contiguous ranges and thread k replays the ops on range k.
+ *    If maint is set, a maintenance thread looks after the heap, waking
+ *    MAINT_WAKES times per idle period. If lat is not NULL, the latency of
+ *    every op is stored there, in no particular order.
+ */
+static void replay_threads(memlib_t *mem, trace_t **traces, int num_traces,
+                           int num_threads, int maint, long *lat,
+                           replay_stats_t *stats) {
+    thread_work_t *work = calloc(num_threads, sizeof(thread_work_t));
+    pthread_t *tids = calloc(num_threads, sizeof(pthread_t));
+    pthread_barrier_t start;
+    int max_ids = 0;
+    mm_heap_t *heap;
+
+    memset(stats, 0, sizeof(*stats));
+    mem_reset_brk_r(mem);
+    if ((heap = mm_heap_create(mem)) == NULL)
+        app_error("mm_heap_create failed in replay_threads");
+    if (maint && mm_heap_start_maintenance(heap, idle_us / MAINT_WAKES) < 0)
+        app_error("mm_heap_start_maintenance failed (built with MM_MAINT=0?)");
+    if (work == NULL || tids == NULL)
+        unix_error("calloc failed in replay_threads");
+    for (int t = 0; t < num_traces; t++) {
+        max_ids = (traces[t]->num_ids > max_ids) ? traces[t]->num_ids : max_ids;
+    }
+    for (int k = 0; k < num_threads; k++) {
+        work[k].traces = traces;
+        work[k].num_traces = num_traces;
+        work[k].first = k % num_traces;
+        work[k].part = (num_traces > 1) ? 0 : k;
+        work[k].num_parts = (num_traces > 1) ? 1 : num_threads;
+        work[k].blocks = calloc(max_ids, sizeof(char *));
+        work[k].block_sizes = calloc(max_ids, sizeof(long));
+        work[k].heap = heap;
+        work[k].start = &start;
+        work[k].lat = (lat == NULL) ? NULL : lat + (long)stats->ops;
+        if (work[k].blocks == NULL || work[k].block_sizes == NULL)
+            unix_error("calloc failed in replay_threads");
+        for (int t = 0; t < num_traces; t++) {
+            for (int i = 0; i < traces[t]->num_ops; i++) {
+                stats->ops += in_part(traces[t], traces[t]->ops[i].index,
+                                      work[k].part, work[k].num_parts);
+            }
+        }
+    }
+
+    pthread_barrier_init(&start, NULL, num_threads);
+    for (int k = 0; k < num_threads; k++) {
+        if (pthread_create(&tids[k], NULL, replay_thread, &work[k]) != 0)
+            unix_error("pthread_create failed in replay_threads");
+    }
+    for (int k = 0; k < num_threads; k++) {
+        pthread_join(tids[k], NULL);
+    }
+    pthread_barrier_destroy(&start);
+    mm_heap_stop_maintenance(heap);
+    stats->heap_size = (long)mem_heapsize_r(mem);
+    stats->passes = mm_heap_maintenance_passes(heap);
+
+    for (int k = 0; k < num_threads; k++) {
+        for (int j = 0; j < num_threads; j++) {
+            double span = elapsed(&work[j].t0, &work[k].t1);
+            stats->secs = (span > stats->secs) ? span : stats->secs;
+        }
+        stats->errors += work[k].errors;
+        free(work[k].blocks);
+        free(work[k].block_sizes);
+    }
+    free(work);
+    free(tids);
+    mm_heap_destroy(heap);
+}
+
+/* Orders latencies, for qsort */
+static int compare_longs(const void *a, const void *b) {
+    long la = *(const long *)a, lb = *(const long *)b;
+    return (la > lb) - (la < lb);
+}
+
+/*
+ * eval_mm_latency - Replays the traces on t threads with idle_us of idle
+ *    time after each trace, once without and once with a maintenance
+ *    thread, and prints percentiles of the op latencies of each run
+ */
+static void eval_mm_latency(memlib_t *mem, trace_t **traces, int num_traces,
+                            int t) {
+    long max_ops = 0;
+    long *lat;
+
+    for (int i = 0; i < num_traces; i++) {
+        max_ops += traces[i]->num_ops;
+    }
+    if ((lat = malloc((max_ops * t + 1) * sizeof(long))) == NULL)
+        unix_error("malloc failed in eval_mm_latency");
+    for (int maint = 0; maint <= 1; maint++) {
+        replay_stats_t stats;
+        replay_threads(mem, traces, num_traces, t, maint, lat, &stats);
+        long n = (long)stats.ops;
+        // a run without a single op (all traces empty) has no percentiles
+        if (n > 0) {
+            qsort(lat, n, sizeof(long), compare_longs);
+            printf("%8d %6s %9ld %8ld %8ld %9ld %9ld %10ld %7ld %7d\n", t,
+                   maint ? "on" : "off", n, lat[n / 2], lat[n * 99 / 100],
+                   lat[n * 999 / 1000], lat[n - 1], stats.heap_size,
+                   stats.passes, stats.errors);
+        }
+        errors += stats.errors;
+        mm_lock_report(stdout);
+        mm_lock_reset();
+    }
+    free(lat);
+}
+
+/*
+ * eval_mm_threads - Replays the traces concurrently on 1, 2, 4, ... up to
+ *    max_threads threads. The threads share one heap, in a memory system
+ *    with room for max_threads traces at once. Normally the best of
+ *    THREAD_REPS runs is kept for each thread count, and the aggregate
+ *    throughput, the speedup over one thread and the largest heap any run
+ *    needed are printed, followed by a lock contention table if mm.c
+ *    was built with MM_LOCK_PROFILE. With -M, the op latencies without and with a
+ *    maintenance thread are compared instead (see eval_mm_latency).
+ */
+static void eval_mm_threads(char **tracefiles, int num_tracefiles,
+                            int max_threads) {
+    trace_t **traces = calloc(num_tracefiles, sizeof(trace_t *));
+    memlib_t *mem = mem_create(max_threads * max_heap);
+    double base_kops = 0;
+
+    if (traces == NULL) unix_error("calloc failed in eval_mm_threads");
+    if (mem == NULL) unix_error("mem_create failed in eval_mm_threads");
+    for (int i = 0; i < num_tracefiles; i++) {
+        traces[i] = read_trace(tracedir, tracefiles[i]);
+    }
+    if (num_tracefiles > 1) {
+        printf("Replaying %d traces on every thread\n", num_tracefiles);
+    } else {
+        printf("Replaying %s with its ids split between threads\n",
+               tracefiles[0]);
+    }
+    if (idle_us > 0) {
+        printf("Idling %ld us after each trace; latencies in ns\n", idle_us);
+        printf("%8s %6s %9s %8s %8s %9s %9s %10s %7s %7s\n", "threads",
+               "maint", "ops", "p50", "p99", "p99.9", "max", "heap", "passes",
+               "errors");
+    } else {
+        printf("%8s %10s %10s %10s %8s %10s %7s\n", "threads", "ops", "secs",
+               "Kops", "speedup", "heap", "errors");
+    }
+    /* 1, 2, 4, ..., always ending on max_threads itself */
+    for (int t = 1;; t = (2 * t < max_threads) ? 2 * t : max_threads) {
+        if (idle_us > 0) {
+            eval_mm_latency(mem, traces, num_tracefiles, t);
+            if (t == max_threads) break;
+            continue;
+        }
+        double best = DBL_MAX, ops = 0;
+        long max_heap = 0;
+        int errs = 0;
+        for (int rep = 0; rep < THREAD_REPS; rep++) {
+            replay_stats_t stats;
+            replay_threads(mem, traces, num_tracefiles, t, 0, NULL, &stats);
+            best = stats.secs < best ? stats.secs : best;
+            ops = stats.ops;
+            max_heap = stats.heap_size > max_heap ? stats.heap_size : max_heap;
+            errs += stats.errors;
+        }
+        double kops = ops / best / 1e3;
+        if (t == 1) base_kops = kops;
+        printf("%8d %10.0f %10.6f %10.0f %7.2fx %10ld %7d\n", t, ops, best,
+               kops, kops / base_kops, max_heap, errs);
+        errors += errs;
+        /* lock contention over the runs, if mm.c was built to profile it */
+        mm_lock_report(stdout);
+        mm_lock_reset();
+        if (t == max_threads) break;
+    }
+    for (int i = 0; i < num_tracefiles; i++) {
+        free_trace(traces[i]);
+    }
+    free(traces);
+    mem_destroy(mem);
+}
+
+/*
+ * trace_thread - The body of one -P replay thread: waits for the others,
+ *    then issues the ops of its trace thread in order. An op with a ^
+ *    marker first waits until the op it depends on is done; those always
+ *    lie earlier in the trace, so the threads cannot deadlock. Payloads
+ *    are filled and checked as in replay_thread.
+ */
+static void *trace_thread(void *ptr) {
+    trace_thread_t *work = ptr;
+    trace_t *trace = work->trace;
+
+    pthread_barrier_wait(work->start);
+    clock_gettime(CLOCK_MONOTONIC, &work->t0);
+    for (int i = 0; i < trace->num_ops; i++) {
+        traceop_t *op = &trace->ops[i];
+        int index = op->index;
+
+        if (op->thread != work->thread) continue;
+        if (op->after >= 0) {
+            while (!__atomic_load_n(&work->done[op->after], __ATOMIC_ACQUIRE))
+                sched_yield();
+        }
+        char *p = trace->blocks[index];
+        long old_size = trace->block_sizes[index];
+        if (op->type != ALLOC && p != NULL && old_size > 0 &&
+            (p[0] != (char)(index & 0xFF) ||
+             p[old_size - 1] != (char)(index & 0xFF))) {
+            work->errors++;
+        }
+        switch (op->type) {
+            case ALLOC:
+                p = mm_heap_malloc(work->heap, op->size);
+                break;
+            case REALLOC:
+                p = mm_heap_realloc(work->heap, p, op->size);
+                break;
+            case FREE:
+                mm_heap_free(work->heap, p);
+                p = NULL;
+                break;
+        }
+        if (op->type != FREE &&
+            ((p == NULL && op->size > 0) || !IS_ALIGNED(p))) {
+            work->errors++;
+            p = NULL;
+        }
+        if (p != NULL) memset(p, index & 0xFF, op->size);
+        trace->blocks[index] = p;
+        trace->block_sizes[index] = (p == NULL) ? 0 : op->size;
+        __atomic_store_n(&work->done[i], 1, __ATOMIC_RELEASE);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &work->t1);
+    return NULL;
+}
+
+/*
+ * replay_traced - Replays a trace on one thread per trace thread, on a
+ *    fresh heap in mem, and stores what the threads did in *stats
+ */
+static void replay_traced(memlib_t *mem, trace_t *trace,
+                          replay_stats_t *stats) {
+    int n = trace->num_threads;
+    trace_thread_t *work = calloc(n, sizeof(trace_thread_t));
+    pthread_t *tids = calloc(n, sizeof(pthread_t));
+    char *done = calloc(trace->num_ops, 1);
+    pthread_barrier_t start;
+    mm_heap_t *heap;
+
+    memset(stats, 0, sizeof(*stats));
+    if (work == NULL || tids == NULL || done == NULL)
+        unix_error("calloc failed in replay_traced");
+    mem_reset_brk_r(mem);
+    if ((heap = mm_heap_create(mem)) == NULL)
+        app_error("mm_heap_create failed in replay_traced");
+    for (int id = 0; id < trace->num_ids; id++) {
+        trace->blocks[id] = NULL;
+        trace->block_sizes[id] = 0;
+    }
+
+    pthread_barrier_init(&start, NULL, n);
+    for (int k = 0; k < n; k++) {
+        work[k].trace = trace;
+        work[k].thread = k;
+        work[k].done = done;
+        work[k].heap = heap;
+        work[k].start = &start;
+        if (pthread_create(&tids[k], NULL, trace_thread, &work[k]) != 0)
+            unix_error("pthread_create failed in replay_traced");
+    }
+    for (int k = 0; k < n; k++) {
+        pthread_join(tids[k], NULL);
+    }
+    pthread_barrier_destroy(&start);
+    stats->ops = trace->num_ops;
+    stats->heap_size = (long)mem_heapsize_r(mem);
+
+    for (int k = 0; k < n; k++) {
+        for (int j = 0; j < n; j++) {
+            double span = elapsed(&work[j].t0, &work[k].t1);
+            stats->secs = (span > stats->secs) ? span : stats->secs;
+        }
+        stats->errors += work[k].errors;
+    }
+    free(work);
+    free(tids);
+    free(done);
+    mm_heap_destroy(heap);
+}
+
+/*
+ * eval_mm_traced_threads - Replays each trace on the threads it names
+ *    (see read_trace), keeping the best of THREAD_REPS runs, and prints
+ *    the throughput, the heap size reached and any errors of each,
+ *    followed by a lock contention table if mm.c was built with
+ *    MM_LOCK_PROFILE
+ */
+static void eval_mm_traced_threads(char **tracefiles, int num_tracefiles) {
+    memlib_t *mem = mem_create(max_heap);
+
+    if (mem == NULL) unix_error("mem_create failed in eval_mm_traced_threads");
+    printf("%-20s %7s %8s %10s %10s %10s %7s\n", "trace", "threads", "ops",
+           "secs", "Kops", "heap", "errors");
+    for (int i = 0; i < num_tracefiles; i++) {
+        trace_t *trace = read_trace(tracedir, tracefiles[i]);
+        double best = DBL_MAX;
+        long peak = 0;
+        int errs = 0;
+        for (int rep = 0; rep < THREAD_REPS; rep++) {
+            replay_stats_t stats;
+            replay_traced(mem, trace, &stats);
+            best = stats.secs < best ? stats.secs : best;
+            peak = stats.heap_size > peak ? stats.heap_size : peak;
+            errs += stats.errors;
+        }
+        printf("%-20s %7d %8d %10.6f %10.0f %10ld %7d\n", trace->trace_name,
+               trace->num_threads, trace->num_ops, best,
+               trace->num_ops / best / 1e3, peak, errs);
+        errors += errs;
+        mm_lock_report(stdout);
+        mm_lock_reset();
+        free_trace(trace);
+    }
+    mem_destroy(mem);
+}
+
+/*
+ * dtlb_open - Open a counter of the dTLB load misses of the calling
+ *    thread in user mode, or return -1 if the host has none
+ */
+static int dtlb_open(void) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* Returns the value of a dTLB counter, or -1 if there is none */
+static long dtlb_read(int fd) {
+    long long count;
+
+    if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count)) {
+        return -1;
+    }
+    return (long)count;
+}
+
+/*
+ * eval_mm_pages - Checks and then times PAGES_REPS replays of each trace,
+ *    on a default heap of small pages and on one of the given kind of huge
+ *    pages (-L). Prints the util, the throughput and the dTLB load misses
+ *    per 1000 ops of both, the latter n/a where the host has no counter for
+ *    them. Growth does not depend on the page kind, so the utils match; a
+ *    build with MM_GROW_UNIT (mdriver-grow2m) shows what growing in whole
+ *    huge pages does on its own. Leave page release off (the default) when
+ *    comparing: with it, every replay hands the heap back and faults it in
+ *    again, which costs far more on small pages than on huge ones.
+ */
+static void eval_mm_pages(char **tracefiles, int num_tracefiles,
+                          int pages) {
+    static const char *names[] = {"small", "thp", "hugetlb"};
+    int kinds[2] = {MEM_PAGES_SMALL, pages};
+    trace_t **traces = calloc(num_tracefiles, sizeof(trace_t *));
+    double *kops = calloc(2 * num_tracefiles, sizeof(double));
+    double *util = calloc(2 * num_tracefiles, sizeof(double));
+    long *misses = calloc(2 * num_tracefiles, sizeof(long));
+    int *valid = calloc(num_tracefiles, sizeof(int));
+    range_t *ranges = NULL;
+    int fd = dtlb_open();
+
+    if (traces == NULL || kops == NULL || util == NULL || misses == NULL ||
+        valid == NULL)
+        unix_error("calloc failed in eval_mm_pages");
+    for (int i = 0; i < num_tracefiles; i++) {
+        traces[i] = read_trace(tracedir, tracefiles[i]);
+    }
+    for (int k = 0; k < 2; k++) {
+        memlib_t *probe;
+        mem_set_pages(kinds[k]);
+        if ((probe = mem_create(max_heap)) == NULL) {
+            fprintf(stderr,
+                    "Could not reserve %ld bytes of %s pages (see -H).\n",
+                    max_heap, names[kinds[k]]);
+            exit(1);
+        }
+        mem_destroy(probe);
+        mem_init_size(max_heap);
+        for (int i = 0; i < num_tracefiles; i++) {
+            speed_t params = {traces[i], NULL};
+            struct timespec start, end;
+            if (k > 0 && !valid[i]) {
+                continue;
+            }
+            if (!(valid[i] = eval_mm_valid(traces[i], i, &ranges))) {
+                continue;
+            }
+            util[2 * i + k] = eval_mm_util(traces[i], i, &ranges);
+            /* The first replay commits and faults in the heap's pages */
+            eval_mm_speed(&params);
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (int rep = 0; rep < PAGES_REPS; rep++) {
+                eval_mm_speed(&params);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            kops[2 * i + k] = (double)traces[i]->num_ops * PAGES_REPS /
+                              elapsed(&start, &end) / 1e3;
+            misses[2 * i + k] = dtlb_read(fd);
+        }
+        mem_deinit();
+    }
+    mem_set_pages(MEM_PAGES_SMALL);
+
+    printf("%-20s %8s %6s %10s %10s %6s %10s %10s\n", "trace", "ops",
+           "util", "small Kops", "dTLB/Kop", "util", "huge Kops", "dTLB/Kop");
+    for (int i = 0; i < num_tracefiles; i++) {
+        double ops = (double)traces[i]->num_ops * PAGES_REPS / 1e3;
+        printf("%-20s %8d", traces[i]->trace_name, traces[i]->num_ops);
+        if (!valid[i]) {
+            printf("   (invalid)\n");
+            continue;
+        }
+        for (int k = 0; k < 2; k++) {
+            printf(" %5.1f%% %10.0f", util[2 * i + k] * 100.0,
+                   kops[2 * i + k]);
+            if (misses[2 * i + k] < 0) {
+                printf(" %10s", "n/a");
+            } else {
+                printf(" %10.2f", misses[2 * i + k] / ops);
+            }
+        }
+        printf("\n");
+    }
+    printf("huge pages: %s\n", names[pages]);
+
+    if (fd >= 0) close(fd);
+    clear_ranges(&ranges);
+    for (int i = 0; i < num_tracefiles; i++) {
+        free_trace(traces[i]);
+    }
+    free(traces);
+    free(kops);
+    free(util);
+    free(misses);
+    free(valid);
+}
+
+/*
+ * replay_growth - Replays a trace on a fresh default heap that logs its
+ *    growth, telling memlib the index of each op before it runs. The heap
+ *    is left for the caller to read the log from and mem_deinit.
+ */
+static void replay_growth(trace_t *trace) {
+    char *p;
+
+    mem_init_size(max_heap);
+    if (mem_growth_start() < 0) app_error("mem_growth_start failed");
+    if (mm_init() < 0) app_error("mm_init failed in replay_growth");
+    for (int i = 0; i < trace->num_ops; i++) {
+        int index = trace->ops[i].index;
+        int size = trace->ops[i].size;
+        mem_growth_op(i);
+        switch (trace->ops[i].type) {
+            case ALLOC:
+                if ((p = mm_malloc(size)) == NULL)
+                    app_error("mm_malloc error in replay_growth");
+                trace->blocks[index] = p;
+                break;
+            case REALLOC:
+                if ((p = mm_realloc(trace->blocks[index], size)) == NULL)
+                    app_error("mm_realloc error in replay_growth");
+                trace->blocks[index] = p;
+                break;
+            case FREE:
+                mm_free(trace->blocks[index]);
+                break;
+            default:
+                app_error("Nonexistent request type in replay_growth");
+        }
+    }
+}
+
+/*
+ * eval_mm_growth - Checks each trace, then replays it on a heap that logs
+ *    every change in its size (-S), and prints how often the heap grew and
+ *    shrank, by how much on average, how large it got and at which op, and
+ *    its size at the end. The sbrk column counts mem_sbrk calls, mm_init's
+ *    included; grows also count segments mapped, shrinks trims and segments
+ *    unmapped. With -C, every change is also written to a CSV file, one
+ *    line per change with its trace, sequence number, op, time in ns since
+ *    mm_init, size change and the heap size afterwards.
+ */
+static void eval_mm_growth(char **tracefiles, int num_tracefiles) {
+    range_t *ranges = NULL;
+    FILE *csv = NULL;
+
+    if (growth_csv != NULL) {
+        if ((csv = fopen(growth_csv, "w")) == NULL)
+            unix_error("could not open the -C file");
+        fprintf(csv, "trace,event,op,ns,incr,size\n");
+    }
+    printf("%-20s %8s %6s %6s %7s %10s %10s %8s %10s\n", "trace", "ops",
+           "sbrk", "grows", "shrinks", "avg grow", "peak heap", "peak op",
+           "end heap");
+    for (int i = 0; i < num_tracefiles; i++) {
+        trace_t *trace = read_trace(tracedir, tracefiles[i]);
+        const mem_growth_event_t *events;
+        long count, grows = 0, grown = 0, shrinks = 0, peak_op = -1;
+        int valid;
+
+        mem_init_size(max_heap);
+        valid = eval_mm_valid(trace, i, &ranges);
+        mem_deinit();
+        printf("%-20s %8d", trace->trace_name, trace->num_ops);
+        if (!valid) {
+            printf("   (invalid)\n");
+            free_trace(trace);
+            continue;
+        }
+        replay_growth(trace);
+        events = mem_growth_events(&count);
+        for (long e = 0; e < count; e++) {
+            if (events[e].incr > 0) {
+                grows++;
+                grown += events[e].incr;
+            } else {
+                shrinks++;
+            }
+            if (events[e].size == mem_heap_peak() && peak_op < 0) {
+                peak_op = events[e].op;
+            }
+            if (csv != NULL) {
+                fprintf(csv, "%s,%ld,%ld,%ld,%ld,%ld\n", trace->trace_name,
+                        e, events[e].op, events[e].ns, events[e].incr,
+                        events[e].size);
+            }
+        }
+        printf(" %6ld %6ld %7ld %10ld %9ldK %8ld %9ldK\n", mem_sbrk_calls(),
+               grows, shrinks, grows ? grown / grows : 0,
+               mem_heap_peak() / 1024, peak_op, mem_heapsize() / 1024);
+        mem_deinit();
+        free_trace(trace);
+    }
+    if (csv != NULL) fclose(csv);
+    clear_ranges(&ranges);
+}
+
+/*
+ * replay_cache - Replays a trace on a fresh default heap with the cache
+ *    simulator reset after mm_init, so that it counts the trace's ops only.
+ *    With -k, each op also writes its payload, as eval_mm_valid does,
+ *    through the simulator; the bytes realloc copies are not seen.
+ */
+static void replay_cache(trace_t *trace) {
+    char *p;
+
+    mem_init_size(max_heap);
+    if (mm_init() < 0) app_error("mm_init failed in replay_cache");
+    mm_cache_reset();
+    for (int i = 0; i < trace->num_ops; i++) {
+        int index = trace->ops[i].index;
+        int size = trace->ops[i].size;
+        switch (trace->ops[i].type) {
+            case ALLOC:
+                if ((p = mm_malloc(size)) == NULL)
+                    app_error("mm_malloc error in replay_cache");
+                if (cache_payloads) mm_cache_access(p, size, MM_CACHE_PAYLOAD);
+                trace->blocks[index] = p;
+                break;
+            case REALLOC:
+                if ((p = mm_realloc(trace->blocks[index], size)) == NULL)
+                    app_error("mm_realloc error in replay_cache");
+                if (cache_payloads) mm_cache_access(p, size, MM_CACHE_PAYLOAD);
+                trace->blocks[index] = p;
+                break;
+            case FREE:
+                mm_free(trace->blocks[index]);
+                break;
+            default:
+                app_error("Nonexistent request type in replay_cache");
+        }
+    }
+    mem_deinit();
+}
+
+/*
+ * eval_mm_cache - Checks each trace, then replays it with its accesses fed
+ *    to the cache simulator (-K), and prints, per kind of access, the
+ *    accesses (one per cache line touched) and the misses at each level,
+ *    per op. Tags and links are only seen by an mm built with MM_CACHE_SIM
+ *    (mdriver-cachesim), and payloads only with -k.
+ */
+static void eval_mm_cache(char **tracefiles, int num_tracefiles) {
+    static const char *kinds[MM_CACHE_KINDS] = {"header", "footer", "link",
+                                                "payload"};
+    range_t *ranges = NULL;
+    mm_cache_stats_t stats;
+
+    mm_cache_stats(&stats);
+    printf("%-20s %8s %-8s %11s", "trace", "ops", "kind", "accesses/op");
+    for (int l = 0; l < stats.levels; l++) {
+        char name[16];
+        if (l + 1 == stats.levels) {
+            strcpy(name, "LLC/op");
+        } else {
+            sprintf(name, "L%d/op", l + 1);
+        }
+        printf(" %9s", name);
+    }
+    printf("\n");
+    for (int i = 0; i < num_tracefiles; i++) {
+        trace_t *trace = read_trace(tracedir, tracefiles[i]);
+        double ops = trace->num_ops;
+        long total_accesses = 0, total_misses[MM_CACHE_LEVELS] = {0};
+        int valid;
+
+        mem_init_size(max_heap);
+        valid = eval_mm_valid(trace, i, &ranges);
+        mem_deinit();
+        printf("%-20s %8d", trace->trace_name, trace->num_ops);
+        if (!valid) {
+            printf("   (invalid)\n");
+            free_trace(trace);
+            continue;
+        }
+        replay_cache(trace);
+        mm_cache_stats(&stats);
+        /* one row per kind, then one that adds them all up */
+        for (int k = 0; k <= MM_CACHE_KINDS; k++) {
+            int total = k == MM_CACHE_KINDS;
+            long accesses = total ? total_accesses : stats.accesses[k];
+            printf("%*s %-8s %11.3f", k ? 29 : 0, "",
+                   total ? "total" : kinds[k], accesses / ops);
+            for (int l = 0; l < stats.levels; l++) {
+                long misses = total ? total_misses[l] : stats.misses[l][k];
+                printf(" %9.4f", misses / ops);
+                total_misses[l] += total ? 0 : misses;
+            }
+            printf("\n");
+            total_accesses += total ? 0 : accesses;
+        }
+        free_trace(trace);
+    }
+    clear_ranges(&ranges);
+}
+
+/*
+ * replay_sim - Replays a trace on a fresh default heap that leaves payloads
+ *    behind on realloc, writing and checking no payload either, and keeps
+ *    count of the bytes allocated just as eval_mm_util does. Returns the
+ *    utilization eval_mm_util would, and stores the peak heap size in peak.
+ */
+static double replay_sim(trace_t *trace, long *peak) {
+    long total_size = 0, max_total_size = 0;
+    char *p;
+
+    mem_init_size(max_heap);
+    if (mm_init() < 0) app_error("mm_init failed in replay_sim");
+    mm_set_copies(0);
+    for (int i = 0; i < trace->num_ops; i++) {
+        int index = trace->ops[i].index;
+        int size = trace->ops[i].size;
+        switch (trace->ops[i].type) {
+            case ALLOC:
+                if ((p = mm_malloc(size)) == NULL && size)
+                    app_error("mm_malloc failed in replay_sim");
+                if (!size) break;
+                trace->blocks[index] = p;
+                trace->block_sizes[index] = size;
+                total_size += size;
+                break;
+            case REALLOC:
+                if ((p = mm_realloc(trace->blocks[index], size)) == NULL &&
+                    size)
+                    app_error("mm_realloc failed in replay_sim");
+                if (!size) break;
+                total_size += size - trace->block_sizes[index];
+                trace->blocks[index] = p;
+                trace->block_sizes[index] = size;
+                break;
+            case FREE:
+                total_size -= trace->block_sizes[index];
+                mm_free(trace->blocks[index]);
+                break;
+            default:
+                app_error("Nonexistent request type in replay_sim");
+        }
+        if (total_size > max_total_size) max_total_size = total_size;
+    }
+    mm_set_copies(1);
+    *peak = mem_heap_peak();
+    mem_deinit();
+    return (double)max_total_size / (double)*peak;
+}
+
+/*
+ * eval_mm_sim - Replays each trace for its utilization and peak heap size
+ *    alone (-U), without the payload writes, range checks and realloc
+ *    copies of eval_mm_util, and prints them with the time it took. The
+ *    blocks are placed by mm itself, so the results are exactly those of
+ *    eval_mm_util, but no payload page is ever touched: only the pages
+ *    that hold tags and links become resident, which lets traces that ask
+ *    for far more than the machine has be measured with a large enough -H.
+ *    The traces are not checked for correctness first. With -u, each trace
+ *    is also run through eval_mm_util, and its utilization and peak heap
+ *    size, time, and whether they match are printed as well.
+ */
+static void eval_mm_sim(char **tracefiles, int num_tracefiles) {
+    range_t *ranges = NULL;
+    int mismatches = 0;
+
+    printf("%-20s %8s %8s %10s %9s", "trace", "ops", "util", "peak heap",
+           "secs");
+    if (sim_check) {
+        printf(" %8s %10s %9s %8s %6s", "real", "real peak", "real secs",
+               "speedup", "match");
+    }
+    printf("\n");
+    for (int i = 0; i < num_tracefiles; i++) {
+        trace_t *trace = read_trace(tracedir, tracefiles[i]);
+        struct timespec start, end;
+        double util, secs;
+        long peak;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        util = replay_sim(trace, &peak);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        secs = elapsed(&start, &end);
+        printf("%-20s %8d %7.2f%% %9ldK %9.4f", trace->trace_name,
+               trace->num_ops, 100 * util, peak / 1024, secs);
+        if (sim_check) {
+            double real_util, real_secs;
+            long real_peak;
+            int match;
+
+            mem_init_size(max_heap);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            real_util = eval_mm_util(trace, i, &ranges);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            real_secs = elapsed(&start, &end);
+            real_peak = mem_heap_peak();
+            mem_deinit();
+            match = real_util == util && real_peak == peak;
+            mismatches += !match;
+            printf(" %7.2f%% %9ldK %9.4f %7.1fx %6s", 100 * real_util,
+                   real_peak / 1024, real_secs, real_secs / secs,
+                   match ? "yes" : "NO");
+        }
+        printf("\n");
+        free_trace(trace);
+    }
+    clear_ranges(&ranges);
+    if (mismatches) {
+        printf("%d trace(s) did not match eval_mm_util\n", mismatches);
+        errors++;
+    }
+}
+
+/*
+ * replay_rss - Replays a trace on a fresh default heap, writing every
+ *    payload as eval_mm_speed does, and samples the heap's size and its
+ *    resident bytes after each op. Stores the largest of each in peak and
+ *    their values after the last op in end.
+ */
+static void replay_rss(trace_t *trace, long peak[2], long end[2]) {
+    char *p;
+
+    peak[0] = peak[1] = end[0] = end[1] = 0;
+    mem_init_size(max_heap);
+    if (mm_init() < 0) app_error("mm_init failed in replay_rss");
+    for (int i = 0; i < trace->num_ops; i++) {
+        int index = trace->ops[i].index;
+        int size = trace->ops[i].size;
+        switch (trace->ops[i].type) {
+            case ALLOC:
+                if ((p = mm_malloc(size)) == NULL)
+                    app_error("mm_malloc error in replay_rss");
+                memset(p, index & 0xFF, size);
+                trace->blocks[index] = p;
+                break;
+            case REALLOC:
+                if ((p = mm_realloc(trace->blocks[index], size)) == NULL)
+                    app_error("mm_realloc error in replay_rss");
+                memset(p, index & 0xFF, size);
+                trace->blocks[index] = p;
+                break;
+            case FREE:
+                mm_free(trace->blocks[index]);
+                break;
+            default:
+                app_error("Nonexistent request type in replay_rss");
+        }
+        end[0] = mem_heapsize();
+        end[1] = mem_resident_r(mem_default());
+        peak[0] = end[0] > peak[0] ? end[0] : peak[0];
+        peak[1] = end[1] > peak[1] ? end[1] : peak[1];
+    }
+    mem_deinit();
+}
+
+/*
+ * eval_mm_rss - Checks each trace, then replays it on a heap of its own
+ *    (-R) and prints the heap size next to the bytes of it that are
+ *    resident, as mincore sees them, at their peaks and after the last op.
+ *    Resident memory below the heap size is memory the allocator handed
+ *    back to the host, or never touched.
+ */
+static void eval_mm_rss(char **tracefiles, int num_tracefiles) {
+    range_t *ranges = NULL;
+
+    printf("%-20s %8s %10s %10s %10s %10s\n", "trace", "ops", "peak heap",
+           "peak rss", "end heap", "end rss");
+    for (int i = 0; i < num_tracefiles; i++) {
+        trace_t *trace = read_trace(tracedir, tracefiles[i]);
+        long peak[2], end[2];
+        int valid;
+
+        mem_init_size(max_heap);
+        valid = eval_mm_valid(trace, i, &ranges);
+        mem_deinit();
+        printf("%-20s %8d", trace->trace_name, trace->num_ops);
+        if (!valid) {
+            printf("   (invalid)\n");
+        } else {
+            replay_rss(trace, peak, end);
+            printf(" %9ldK %9ldK %9ldK %9ldK\n", peak[0] / 1024,
+                   peak[1] / 1024, end[0] / 1024, end[1] / 1024);
+        }
+        free_trace(trace);
+    }
+    clear_ranges(&ranges);
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -1078,11 +2336,77 @@ void malloc_error(int tracenum, int opnum, char *msg) {
     (void)(ret);  // suppress unused result warnings
 }
 
+/*
+ * parse_cache - Set up the cache simulator as arg describes: "default", or
+ *    a comma-separated list of levels from L1 outwards, each <size>:<ways>,
+ *    e.g. 32k:8,256k:8,8m:16. Returns 0, or -1 if arg is not one.
+ */
+static int parse_cache(char *arg) {
+    long size[MM_CACHE_LEVELS];
+    int ways[MM_CACHE_LEVELS];
+    int levels = 0;
+    char *save = NULL;
+
+    if (!strcmp(arg, "default")) {
+        return mm_cache_configure(0, NULL, NULL);
+    }
+    for (char *level = strtok_r(arg, ",", &save); level != NULL;
+         level = strtok_r(NULL, ",", &save)) {
+        char *colon = strchr(level, ':');
+        if (levels == MM_CACHE_LEVELS || colon == NULL) {
+            return -1;
+        }
+        *colon = '\0';
+        size[levels] = parse_size(level);
+        ways[levels] = atoi(colon + 1);
+        levels++;
+    }
+    return levels == 0 ? -1 : mm_cache_configure(levels, size, ways);
+}
+
+/*
+ * parse_size - Return the byte count in arg, a number with an optional
+ *    k, m or g suffix (binary multiples), or -1 if it is not one
+ */
+static long parse_size(const char *arg) {
+    char *end;
+    long size = strtol(arg, &end, 10);
+    int shift = 0;
+
+    switch (*end) {
+        case 'k':
+        case 'K':
+            shift = 10;
+            break;
+        case 'm':
+        case 'M':
+            shift = 20;
+            break;
+        case 'g':
+        case 'G':
+            shift = 30;
+            break;
+        case '\0':
+            break;
+        default:
+            return -1;
+    }
+    if (end == arg || (shift && end[1] != '\0') || size < 0 ||
+        size > (LONG_MAX >> shift)) {
+        return -1;
+    }
+    return size << shift;
+}
+
 /*
  * usage - Explain the command line arguments
  */
 static void usage(void) {
-    fprintf(stderr, "Usage: mdriver [-hvValr] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr,
+            "Usage: mdriver [-hvValrPRSUu] [-f <file>] [-t <dir>] [-T <n>] "
+            "[-M <us>] [-H <size>]\n"
+            "               [-L <thp|hugetlb>] [-W <percent>] "
+            "[-C <file>] [-K <levels> [-k]]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
     fprintf(stderr, "\t-r         Open the malloc REPL.\n");
@@ -1090,6 +2414,40 @@ static void usage(void) {
     fprintf(stderr, "\t-h         Print this message.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr, "\t-T <n>     Replay traces on 1 to <n> threads.\n");
+    fprintf(stderr, "\t-P         Replay each trace on one thread per "
+                    "trace thread.\n");
+    fprintf(stderr, "\t-M <us>    With -T, idle <us> after each trace and "
+                    "compare op\n\t           latencies without and with a "
+                    "maintenance thread.\n");
+    fprintf(stderr, "\t-H <size>  Reserve <size> bytes for simulated heaps "
+                    "(k, m, g suffixes\n\t           allowed; default "
+                    "20m); beyond that they grow in\n\t           "
+                    "segments.\n");
+    fprintf(stderr, "\t-L <kind>  Compare util, throughput and dTLB misses "
+                    "on small\n\t           pages and on thp or hugetlb "
+                    "huge pages.\n");
+    fprintf(stderr, "\t-R         Report resident memory next to the heap "
+                    "size, at the\n\t           peak and at the end of "
+                    "each trace.\n");
+    fprintf(stderr, "\t-S         Summarize how often, by how much and "
+                    "when each trace's\n\t           heap grew.\n");
+    fprintf(stderr, "\t-C <file>  As -S, and write every change in heap "
+                    "size to <file>\n\t           as CSV.\n");
+    fprintf(stderr, "\t-K <lvls>  Count simulated cache misses per op "
+                    "and access kind, for\n\t           levels like "
+                    "32k:8,256k:8,8m:16 (<size>:<ways>) or\n\t           "
+                    "default. Tags and links need mdriver-cachesim.\n");
+    fprintf(stderr, "\t-k         With -K, simulate the payload writes "
+                    "as well.\n");
+    fprintf(stderr, "\t-U         Measure each trace's utilization and "
+                    "peak heap size\n\t           alone, without writing "
+                    "any payload.\n");
+    fprintf(stderr, "\t-u         As -U, and check the results against "
+                    "the usual run.\n");
+    fprintf(stderr, "\t-W <pct>   Run the first <pct>%% of each trace once, "
+                    "untimed, and\n\t           time only the rest, "
+                    "restoring a checkpoint.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
     fprintf(stderr, "\t-p         activates repl\n");
@@ -1156,20 +2514,19 @@ repl_block_t *find_repl_block_from_block(char *block_ptr, repl_block_t blocks[],
 }
 
 /*
- * prints the state of the heap
- * arguments: none
- * returns: nothing
+ * print_heap_range - Print the blocks of one range of the heap, the range
+ *    below the brk or a segment, from its prologue at start to its epilogue
+ *    right before end
  */
-void mm_print_heap_repl(repl_block_t blocks[], int repl_size) {
-    // prints heap data & prologue
-    block_t *heap_start = (block_t *)mem_heap_lo();
-    printf("heap size: %d\n", (int)mem_heapsize());
+static void print_heap_range(char *start, char *end, repl_block_t blocks[],
+                             int repl_size) {
+    block_t *heap_start = (block_t *)start;
     block_t *b = (block_t *)heap_start;
     printf("prologue \t\tblock at %p \tsize %d\n", (void *)heap_start,
            (int)block_size(heap_start));
     b = block_next(b);
 
-    block_t *epilogue = (block_t *)((char *)mem_heap_hi() - TAGS_SIZE + 1);
+    block_t *epilogue = (block_t *)(end - TAGS_SIZE);
     // prints all blocks
     while (b != epilogue) {
         int index = -1;
@@ -1196,7 +2553,8 @@ void mm_print_heap_repl(repl_block_t blocks[], int repl_size) {
                 (void *)block_blink(b));
         }
         long s1 = block_size(b);
-        long s2 = block_end_size(b);
+        /* allocated blocks have no end tag when mm is built without footers */
+        long s2 = block_allocated(b) ? s1 : block_end_size(b);
         if (s1 != s2) {
             printf("block%s at %p had differing size tags: %d and %d\n\n",
                    indexstr, (void *)b, (int)s1, (int)s2);
@@ -1212,7 +2570,25 @@ void mm_print_heap_repl(repl_block_t blocks[], int repl_size) {
     }
     printf("epilogue \t\tblock at %p \tsize %d\n\n\n", (void *)(epilogue),
            (int)block_size(epilogue));
-    // return 0;
+}
+
+/*
+ * prints the state of the heap: the range below the brk, then each segment
+ * arguments: none
+ * returns: nothing
+ */
+void mm_print_heap_repl(repl_block_t blocks[], int repl_size) {
+    long size;
+    char *segment = NULL;
+
+    printf("heap size: %d\n", (int)mem_heapsize());
+    print_heap_range(mem_heap_lo(), (char *)mem_heap_hi() + 1, blocks,
+                     repl_size);
+    while ((segment = mem_segment_next_r(mem_default(), segment, &size)) !=
+           NULL) {
+        printf("segment of %ld bytes at %p\n", size, (void *)segment);
+        print_heap_range(segment, segment + size, blocks, repl_size);
+    }
 }
 
 void help_cmd(const char *msg) {
@@ -1423,7 +2799,7 @@ void remalloc_cmd(const char *msg) {
     int oldsize = repl_state->blocks[index].size;
     if (size < oldsize) oldsize = size;
     for (j = 0; j < oldsize; j++) {
-        if (newp[j] != (index & 0xFF)) {
+        if (newp[j] != (char)(index & 0xFF)) {
             malloc_error(repl_state->tracenum, repl_state->num_ops,
                          "mm_realloc did not preserve the "
                          "data from old block");
@@ -1461,7 +2837,7 @@ static void driver() {
     int ret;
     unsigned i;
     repl_state = make_repl_state(MAX_REPL_SIZE);
-    mem_init();
+    mem_init_size(max_heap);
     reset_cmd("");
     printf(
         "Welcome to the Malloc REPL. (Enter 'help' to see available "
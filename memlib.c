@@ -2,78 +2,1018 @@
  * memlib.c - a module that simulates the memory system.  Needed because it
  *            allows us to interleave calls from the student's malloc package
  *            with the system's malloc package in libc.
+ *
+ *            Every simulated heap is a memlib_t instance, so several heaps can
+ *            live side by side in one process. The original single-heap API
+ *            (mem_init, mem_sbrk, ...) operates on a default instance.
+ *
+ *            The brk pointer is only ever moved with atomic operations, so
+ *            several threads may extend one heap without a lock.
+ *
+ *            A heap's storage is a range of address space reserved with
+ *            mmap(PROT_NONE), so creating even a very large heap costs
+ *            nothing. Pages are made accessible with mprotect, in steps of
+ *            MEM_COMMIT_STEP bytes, as the brk pointer first passes them.
+ *
+ *            Heaps can also be backed by 2 MB huge pages (see
+ *            mem_set_pages), which makes the TLB cover 512 times as much of
+ *            a large heap. Their size is then rounded up to whole huge
+ *            pages, and they are committed a huge page at a time.
+ *
+ *            The pages under a range of the heap that the allocator no
+ *            longer uses can be handed back to the host with
+ *            mem_release_r; mem_resident_r tells how much of a heap is
+ *            actually in physical memory.
+ *
+ *            When the reserved range is used up, a heap can go on growing
+ *            in segments (mem_map_segment_r): further ranges mapped
+ *            wherever the host puts them, each used by the allocator on its
+ *            own and unmapped again when empty. The heap's size includes
+ *            them.
+ *
+ *            Every heap counts its mem_sbrk_r calls and remembers its
+ *            largest size. Once mem_growth_start_r is called, it also logs
+ *            every change in its size, with when it happened and at which
+ *            op, as set by the caller with mem_growth_op_r.
+ *
+ *            mem_checkpoint_r copies a heap's bytes and brk aside, and
+ *            mem_restore_r puts them back, so that a run can be repeated
+ *            from the same point without replaying what led up to it.
+ *
+ *            A heap can also live in a file (see mem_open_file) or a
+ *            shared memory object (mem_open_shared), mapped by several
+ *            processes at once or by one after another. The brk of such a
+ *            heap is kept in the first page of the file, so that all of
+ *            them move the same one, and the whole heap is accessible from
+ *            the start, since other processes may grow it.
  */
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "config.h"
 #include "memlib.h"
 
-/* private variables */
-static char *mem_start_brk; /* points to first byte of heap */
-static char *mem_brk;       /* points to last byte of heap */
-static char *mem_max_addr;  /* largest legal heap address */
+#define MEM_COMMIT_STEP (64 * 1024) /* bytes made accessible at once */
+#define MEM_HUGE_PAGE (2L << 20)    /* bytes per huge page */
+#define MEM_RESIDENT_BATCH 4096     /* pages looked up per mincore call */
+#define MEM_FILE_MAGIC "MEMLIB1"    /* marks the first page of a heap file */
+#define MEM_GROWTH_EVENTS 256       /* first capacity of a growth log */
+
+/* rounds ptr up to a multiple of align, a power of 2 */
+#define ALIGN_UP(ptr, align) \
+    ((char *)(((unsigned long)(ptr) + (align)-1) & ~((unsigned long)(align)-1)))
+
+/* one discontiguous piece of a heap, see mem_map_segment_r */
+typedef struct mem_segment {
+    char *start;
+    long size;
+    struct mem_segment *next; /* the segment at the next higher address */
+} mem_segment_t;
+
+/* the log of a heap's size changes, see mem_growth_start_r */
+typedef struct {
+    pthread_mutex_t lock; /* taken to add an event */
+    mem_growth_event_t *events;
+    long count, capacity;
+    long op;       /* the op that changes are logged under */
+    long start_ns; /* when logging started */
+} mem_growth_t;
+
+/* state of one simulated heap */
+struct memlib {
+    char *mem_start_brk;     /* points to first byte of heap */
+    char *mem_brk;           /* points to last byte of heap */
+    char *mem_max_addr;      /* largest legal heap address */
+    char *mem_committed;     /* end of the accessible part of the storage */
+    long page_size;          /* bytes per page of the storage */
+    int owns_storage;        /* whether mem_start_brk came from mmap */
+    int fd;                  /* the file behind the heap, or -1 */
+    long *file_brk;          /* the brk of a heap file, as an offset, or NULL */
+    mem_segment_t *segments; /* mapped by mem_map_segment_r, by address */
+    long segment_bytes;      /* their total size */
+    long peak_bytes;         /* the largest heap size since the last reset */
+    long sbrk_calls;         /* mem_sbrk_r calls since the last reset */
+    mem_growth_t *growth;    /* the growth log, or NULL if not logging */
+};
+
+/* a copy of a heap, see mem_checkpoint_r */
+struct mem_checkpoint {
+    long size;    /* the heap's size, from which its brk follows */
+    char bytes[]; /* its contents */
+};
+
+/* the first page of a heap file */
+typedef struct {
+    char magic[8]; /* MEM_FILE_MAGIC */
+    long max_heap; /* bytes of heap the file holds, after this page */
+    long brk;      /* bytes of them in use */
+} mem_file_header_t;
+
+/* the instance behind the single-heap API */
+static memlib_t default_mem;
+
+/* the pages behind heaps opened from now on */
+static int mem_pages = MEM_PAGES_SMALL;
 
 /*
- * mem_init - initialize the memory system model
+ * mem_set_pages - choose the pages behind the heaps that mem_init and
+ *    mem_create open from now on: MEM_PAGES_SMALL (the default),
+ *    MEM_PAGES_THP or MEM_PAGES_HUGETLB. Returns 0, or -1 if the mode is not
+ *    known on this system. Whether the host actually has huge pages to give
+ *    only shows when a heap is opened.
  */
-void mem_init(void) {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-        fprintf(stderr, "mem_init_vm: malloc error\n");
-        exit(1);
+int mem_set_pages(int pages) {
+    switch (pages) {
+        case MEM_PAGES_SMALL:
+#ifdef MADV_HUGEPAGE
+        case MEM_PAGES_THP:
+#endif
+#ifdef MAP_HUGETLB
+        case MEM_PAGES_HUGETLB:
+#endif
+            mem_pages = pages;
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+/*
+ * mem_open - reserve the address space for a heap of max_heap bytes into
+ *    mem. None of it is accessible yet. With MEM_PAGES_THP, the range is
+ *    aligned to a huge page and marked MADV_HUGEPAGE. A MEM_PAGES_HUGETLB
+ *    range is reserved from the huge page pool right away, so that a short
+ *    pool makes this fail instead of a later page fault.
+ */
+static int mem_open(memlib_t *mem, long max_heap) {
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+    long slop = 0; /* extra bytes mapped, to align the start */
+    char *start;
+
+    if (max_heap <= 0) {
+        return -1;
+    }
+    mem->page_size =
+        mem_pages == MEM_PAGES_SMALL ? mem_pagesize() : MEM_HUGE_PAGE;
+    max_heap = (long)ALIGN_UP(max_heap, mem->page_size);
+    if (mem_pages == MEM_PAGES_THP) {
+        slop = MEM_HUGE_PAGE;
+    }
+#ifdef MAP_HUGETLB
+    if (mem_pages == MEM_PAGES_HUGETLB) {
+        flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+    }
+#endif
+    start = mmap(NULL, max_heap + slop, PROT_NONE, flags, -1, 0);
+    if (start == MAP_FAILED) {
+        return -1;
     }
+    if (slop > 0) {
+        char *aligned = ALIGN_UP(start, MEM_HUGE_PAGE);
+        if (aligned > start) {
+            munmap(start, aligned - start);
+        }
+        if (aligned < start + slop) {
+            munmap(aligned + max_heap, start + slop - aligned);
+        }
+        start = aligned;
+#ifdef MADV_HUGEPAGE
+        madvise(start, max_heap, MADV_HUGEPAGE);
+#endif
+    }
+    mem->mem_start_brk = start;
+    mem->mem_max_addr = mem->mem_start_brk + max_heap; /* max legal address */
+    mem->mem_brk = mem->mem_start_brk; /* heap is empty initially */
+    mem->mem_committed = mem->mem_start_brk;
+    mem->owns_storage = 1;
+    mem->fd = -1;
+    mem->file_brk = NULL;
+    mem->segments = NULL;
+    mem->segment_bytes = 0;
+    mem->peak_bytes = 0;
+    mem->sbrk_calls = 0;
+    mem->growth = NULL;
+    return 0;
+}
 
-    mem_max_addr = mem_start_brk + MAX_HEAP; /* max legal heap address */
-    mem_brk = mem_start_brk;                 /* heap is empty initially */
+/*
+ * mem_unmap_segments - unmap every segment of mem
+ */
+static void mem_unmap_segments(memlib_t *mem) {
+    while (mem->segments != NULL) {
+        mem_segment_t *segment = mem->segments;
+        mem->segments = segment->next;
+        munmap(segment->start, segment->size);
+        free(segment);
+    }
+    mem->segment_bytes = 0;
 }
 
 /*
- * mem_deinit - free the storage used by the memory system model
+ * mem_close - release the address space reserved by mem_open
  */
-void mem_deinit(void) { free(mem_start_brk); }
+static void mem_close(memlib_t *mem) {
+    mem_unmap_segments(mem);
+    if (mem->fd >= 0) {
+        /* the file's first page is mapped too */
+        munmap(mem->mem_start_brk - mem->page_size,
+               mem->mem_max_addr - mem->mem_start_brk + mem->page_size);
+        close(mem->fd);
+        return;
+    }
+    munmap(mem->mem_start_brk, mem->mem_max_addr - mem->mem_start_brk);
+}
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_get_brk - return the brk pointer of mem, which a heap file keeps in
+ *    the file rather than in mem_brk
  */
-void mem_reset_brk() { mem_brk = mem_start_brk; }
+static char *mem_get_brk(memlib_t *mem) {
+    if (mem->file_brk != NULL) {
+        return mem->mem_start_brk +
+               __atomic_load_n(mem->file_brk, __ATOMIC_ACQUIRE);
+    }
+    return __atomic_load_n(&mem->mem_brk, __ATOMIC_ACQUIRE);
+}
 
 /*
- * mem_sbrk - simple model of the sbrk function. Extends the heap
+ * mem_set_brk - move the brk pointer of mem to brk. Must not race with
+ *    mem_sbrk_r.
+ */
+static void mem_set_brk(memlib_t *mem, char *brk) {
+    if (mem->file_brk != NULL) {
+        __atomic_store_n(mem->file_brk, brk - mem->mem_start_brk,
+                         __ATOMIC_RELEASE);
+    } else {
+        __atomic_store_n(&mem->mem_brk, brk, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * mem_commit - make the storage of mem accessible up to end, rounded up to
+ *    the next MEM_COMMIT_STEP or page, whichever is larger. Returns 0, or -1
+ *    if the host refused. Threads that race here may mprotect the same pages
+ *    twice, which is harmless; the CAS only keeps mem_committed from moving
+ *    backwards. A chunk's pages may stick out of it into its parent's, which
+ *    is just as harmless.
+ */
+static int mem_commit(memlib_t *mem, char *end) {
+    char *committed = __atomic_load_n(&mem->mem_committed, __ATOMIC_ACQUIRE);
+    long page = mem->page_size;
+    long step = page > MEM_COMMIT_STEP ? page : MEM_COMMIT_STEP;
+    char *limit = ALIGN_UP(mem->mem_max_addr, page);
+
+    while (committed < end) {
+        char *from = (char *)((unsigned long)committed & ~(page - 1));
+        char *to = ALIGN_UP(end, step);
+        if (to > limit) {
+            to = limit;
+        }
+        if (mprotect(from, to - from, PROT_READ | PROT_WRITE) < 0) {
+            return -1;
+        }
+        if (__atomic_compare_exchange_n(&mem->mem_committed, &committed, to, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+    }
+    return 0;
+}
+
+/*
+ * mem_create - create a new, empty simulated heap that can grow to max_heap
+ *    bytes. Returns NULL if the address space could not be reserved.
+ */
+memlib_t *mem_create(long max_heap) {
+    memlib_t *mem;
+
+    if ((mem = (memlib_t *)malloc(sizeof(memlib_t))) == NULL) {
+        return NULL;
+    }
+    if (mem_open(mem, max_heap) < 0) {
+        free(mem);
+        return NULL;
+    }
+    return mem;
+}
+
+/*
+ * mem_map_fd - map the heap kept in the open file fd, making it a heap file
+ *    with room for max_heap bytes of heap if it is empty, and take over fd.
+ *    Returns NULL, with errno set, if that fails or the file is not a heap
+ *    file.
+ */
+static memlib_t *mem_map_fd(int fd, long max_heap) {
+    long page = mem_pagesize();
+    mem_file_header_t header;
+    memlib_t *mem;
+    char *map;
+    ssize_t got;
+
+    if ((got = pread(fd, &header, sizeof(header), 0)) == 0) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, MEM_FILE_MAGIC, sizeof(header.magic));
+        header.max_heap = (long)ALIGN_UP(max_heap, page);
+        if (max_heap <= 0 || ftruncate(fd, page + header.max_heap) < 0 ||
+            pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+            close(fd);
+            return NULL;
+        }
+    } else if (got != sizeof(header) ||
+               memcmp(header.magic, MEM_FILE_MAGIC, sizeof(header.magic)) ||
+               header.brk < 0 || header.brk > header.max_heap) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    map = mmap(NULL, page + header.max_heap, PROT_READ | PROT_WRITE, MAP_SHARED,
+               fd, 0);
+    if (map == MAP_FAILED ||
+        (mem = (memlib_t *)malloc(sizeof(memlib_t))) == NULL) {
+        if (map != MAP_FAILED) {
+            munmap(map, page + header.max_heap);
+        }
+        close(fd);
+        return NULL;
+    }
+    mem->mem_start_brk = map + page;
+    mem->mem_max_addr = mem->mem_start_brk + header.max_heap;
+    mem->mem_brk = NULL; /* see file_brk */
+    mem->mem_committed = mem->mem_max_addr;
+    mem->page_size = page;
+    mem->owns_storage = 1;
+    mem->fd = fd;
+    mem->file_brk = &((mem_file_header_t *)map)->brk;
+    mem->segments = NULL;
+    mem->segment_bytes = 0;
+    mem->peak_bytes = mem_heapsize_r(mem);
+    mem->sbrk_calls = 0;
+    mem->growth = NULL;
+    return mem;
+}
+
+/*
+ * mem_open_file - map the heap kept in the file at path, creating the file
+ *    with room for max_heap bytes of heap if it does not exist yet (an
+ *    existing file keeps its own size). The heap has the size it had when
+ *    last used, and the contents, but may be mapped at another address.
+ *    Returns NULL, with errno set, if the file cannot be opened or is not a
+ *    heap file. Always uses small pages.
+ */
+memlib_t *mem_open_file(const char *path, long max_heap) {
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+
+    return fd < 0 ? NULL : mem_map_fd(fd, max_heap);
+}
+
+/*
+ * mem_open_shared - like mem_open_file, on the POSIX shared memory object of
+ *    the given name (see shm_open), which lives until mem_unlink_shared.
+ *    Every process that opens it maps the same heap.
+ */
+memlib_t *mem_open_shared(const char *name, long max_heap) {
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+
+    return fd < 0 ? NULL : mem_map_fd(fd, max_heap);
+}
+
+/*
+ * mem_unlink_shared - remove the shared memory object of the given name.
+ *    Processes that have it open keep their mappings. Returns 0, or -1.
+ */
+int mem_unlink_shared(const char *name) { return shm_unlink(name); }
+
+/*
+ * mem_sync_r - write a file-backed heap back to its file, waiting until it
+ *    is done. Returns 0, or -1 if that failed. Does nothing for other heaps.
+ */
+int mem_sync_r(memlib_t *mem) {
+    char *brk = mem_get_brk(mem);
+    char *map = mem->mem_start_brk - mem->page_size;
+
+    if (mem->fd < 0) {
+        return 0;
+    }
+    return msync(map, ALIGN_UP(brk, mem->page_size) - map, MS_SYNC);
+}
+
+/*
+ * mem_destroy - free a heap created by mem_create, mem_open_file,
+ *    mem_open_shared or mem_sbrk_chunk. The storage of a chunk belongs to its
+ *    parent and stays where it is; a file keeps its heap for the next open.
+ */
+void mem_destroy(memlib_t *mem) {
+    mem_growth_stop_r(mem);
+    if (mem->owns_storage) {
+        mem_close(mem);
+    }
+    free(mem);
+}
+
+/*
+ * mem_default - return the instance used by the single-heap API
+ */
+memlib_t *mem_default(void) { return &default_mem; }
+
+/*
+ * mem_reset_brk_r - reset the simulated brk pointer to make an empty heap
+ */
+void mem_reset_brk_r(memlib_t *mem) {
+    mem_unmap_segments(mem);
+    mem_set_brk(mem, mem->mem_start_brk);
+    mem->peak_bytes = 0;
+    mem->sbrk_calls = 0;
+}
+
+/*
+ * mem_now_ns - return the time of the monotonic clock, in ns
+ */
+static long mem_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * mem_note_size - take note of a change of incr bytes in mem's size: raise
+ *    its peak heap size to its current size, if that is larger, and log the
+ *    change if mem logs its growth. Safe to call from several threads at
+ *    once.
+ */
+static void mem_note_size(memlib_t *mem, long incr) {
+    long size = mem_heapsize_r(mem);
+    long peak = __atomic_load_n(&mem->peak_bytes, __ATOMIC_RELAXED);
+    mem_growth_t *growth = mem->growth;
+
+    while (size > peak &&
+           !__atomic_compare_exchange_n(&mem->peak_bytes, &peak, size, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    if (growth == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&growth->lock);
+    if (growth->count == growth->capacity) {
+        long capacity = 2 * growth->capacity;
+        mem_growth_event_t *events =
+            realloc(growth->events, capacity * sizeof(mem_growth_event_t));
+        if (events == NULL) {
+            pthread_mutex_unlock(&growth->lock);
+            return; /* the log just stops */
+        }
+        growth->events = events;
+        growth->capacity = capacity;
+    }
+    growth->events[growth->count++] = (mem_growth_event_t){
+        growth->op, mem_now_ns() - growth->start_ns, incr, size};
+    pthread_mutex_unlock(&growth->lock);
+}
+
+/*
+ * mem_bump - move the brk pointer up by incr bytes and return its old
+ *    value, or NULL if that would pass mem_max_addr. The common case is a
+ *    single fetch-add. One that overshoots is rolled back, after which a
+ *    CAS loop decides; near the limit, a request can still fail while the
+ *    rollback of another one is pending. A heap file, which other processes
+ *    may be growing too, is only ever grown with a CAS on its offset.
+ */
+static char *mem_bump(memlib_t *mem, long incr) {
+    char *old_brk;
+
+    if (mem->file_brk != NULL) {
+        long max = mem->mem_max_addr - mem->mem_start_brk;
+        long old = __atomic_load_n(mem->file_brk, __ATOMIC_ACQUIRE);
+        do {
+            if (old + incr > max) {
+                return NULL;
+            }
+        } while (!__atomic_compare_exchange_n(mem->file_brk, &old, old + incr,
+                                              1, __ATOMIC_ACQ_REL,
+                                              __ATOMIC_ACQUIRE));
+        return mem->mem_start_brk + old;
+    }
+    old_brk = __atomic_fetch_add(&mem->mem_brk, incr, __ATOMIC_ACQ_REL);
+    if (old_brk + incr <= mem->mem_max_addr) {
+        return old_brk;
+    }
+    __atomic_fetch_sub(&mem->mem_brk, incr, __ATOMIC_ACQ_REL);
+    old_brk = __atomic_load_n(&mem->mem_brk, __ATOMIC_ACQUIRE);
+    do {
+        if (old_brk + incr > mem->mem_max_addr) {
+            return NULL;
+        }
+    } while (!__atomic_compare_exchange_n(&mem->mem_brk, &old_brk,
+                                          old_brk + incr, 1, __ATOMIC_ACQ_REL,
+                                          __ATOMIC_ACQUIRE));
+    return old_brk;
+}
+
+/*
+ * mem_sbrk_r - simple model of the sbrk function. Extends the heap
  *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    this model, the heap can only be shrunk with mem_trim_r. Safe to call
+ *    from several threads at once.
  */
-void *mem_sbrk(int incr) {
-    char *old_brk = mem_brk;
+void *mem_sbrk_r(memlib_t *mem, long incr) {
+    char *old_brk;
 
-    if ((incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    __atomic_add_fetch(&mem->sbrk_calls, 1, __ATOMIC_RELAXED);
+    if ((incr < 0) || (old_brk = mem_bump(mem, incr)) == NULL) {
         errno = ENOMEM;
         fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
         return (void *)-1;
     }
-    mem_brk += incr;
+    if (mem_commit(mem, old_brk + incr) < 0) {
+        // give the bytes back, unless a later call has moved brk already (a
+        // heap file is committed whole, so never gets here)
+        char *new_brk = old_brk + incr;
+        __atomic_compare_exchange_n(&mem->mem_brk, &new_brk, old_brk, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+        errno = ENOMEM;
+        fprintf(stderr, "ERROR: mem_sbrk failed. Could not commit memory...\n");
+        return (void *)-1;
+    }
+    mem_note_size(mem, incr);
     return (void *)old_brk;
 }
 
+/*
+ * mem_trim_r - shrink the heap by decr bytes. The pages that lie wholly
+ *    above the new brk are handed back to the host with mem_release_r; they
+ *    stay committed and read as zeros when the heap grows over them again.
+ *    Returns 0, or -1 if the heap is smaller than decr. Must not race with
+ *    mem_sbrk_r on the same heap.
+ */
+int mem_trim_r(memlib_t *mem, long decr) {
+    char *old_brk = mem_get_brk(mem);
+
+    if (decr < 0 || old_brk - mem->mem_start_brk < decr) {
+        return -1;
+    }
+    mem_set_brk(mem, old_brk - decr);
+    mem_note_size(mem, -decr);
+    mem_release_r(mem, old_brk - decr, old_brk);
+    return 0;
+}
+
+/*
+ * mem_release_r - hand the pages that lie wholly between start and end back
+ *    to the host with madvise(MADV_DONTNEED). They stay part of the heap and
+ *    accessible, and read as zeros when next touched. Huge pages are only
+ *    released whole, so as not to split them. Returns the bytes released.
+ */
+long mem_release_r(memlib_t *mem, void *start, void *end) {
+    char *from = ALIGN_UP(start, mem->page_size);
+    char *to = (char *)((unsigned long)end & ~(mem->page_size - 1));
+
+    if (to <= from || madvise(from, to - from, MADV_DONTNEED) < 0) {
+        return 0;
+    }
+    return to - from;
+}
+
+/*
+ * mem_resident_range - return the bytes of the pages from start to end that
+ *    are in physical memory, or -1 if mincore cannot tell
+ */
+static long mem_resident_range(char *start, char *end) {
+    long page = mem_pagesize();
+    unsigned char vec[MEM_RESIDENT_BATCH];
+    char *from = (char *)((unsigned long)start & ~(page - 1));
+    char *to = ALIGN_UP(end, page);
+    long resident = 0;
+
+    while (from < to) {
+        long pages = (to - from) / page;
+        if (pages > MEM_RESIDENT_BATCH) {
+            pages = MEM_RESIDENT_BATCH;
+        }
+        if (mincore(from, pages * page, vec) < 0) {
+            return -1;
+        }
+        for (long i = 0; i < pages; i++) {
+            resident += vec[i] & 1;
+        }
+        from += pages * page;
+    }
+    return resident * page;
+}
+
+/*
+ * mem_resident_r - return the bytes of the heap, segments included, that
+ *    are in physical memory, as mincore sees them, or -1 if it cannot tell
+ */
+long mem_resident_r(memlib_t *mem) {
+    long resident = mem_resident_range(mem->mem_start_brk, mem_get_brk(mem));
+
+    for (mem_segment_t *s = mem->segments; s != NULL && resident >= 0;
+         s = s->next) {
+        long more = mem_resident_range(s->start, s->start + s->size);
+        resident = more < 0 ? -1 : resident + more;
+    }
+    return resident;
+}
+
+/*
+ * mem_room_r - return the bytes mem_sbrk_r can still grow the heap by
+ */
+long mem_room_r(memlib_t *mem) { return mem->mem_max_addr - mem_get_brk(mem); }
+
+/*
+ * mem_map_segment_r - map a segment of at least size bytes for mem's heap,
+ *    somewhere outside the reserved range, and return its start. Only heaps
+ *    that own their memory and live in no file have segments; for others,
+ *    and if the host has no memory left, returns NULL. Must not race with
+ *    the other segment calls on the same heap.
+ */
+void *mem_map_segment_r(memlib_t *mem, long size) {
+    mem_segment_t *segment, **at;
+    char *start;
+
+    if (!mem->owns_storage || mem->fd >= 0 || size <= 0) {
+        errno = ENOTSUP;
+        return NULL;
+    }
+    size = (long)ALIGN_UP(size, mem_pagesize());
+    if ((segment = malloc(sizeof(mem_segment_t))) == NULL) {
+        return NULL;
+    }
+    start = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (start == MAP_FAILED) {
+        free(segment);
+        return NULL;
+    }
+    segment->start = start;
+    segment->size = size;
+    for (at = &mem->segments; *at != NULL && (*at)->start < start;
+         at = &(*at)->next) {
+    }
+    segment->next = *at;
+    *at = segment;
+    mem->segment_bytes += size;
+    mem_note_size(mem, size);
+    return start;
+}
+
+/*
+ * mem_unmap_segment_r - unmap the segment of mem that starts at start,
+ *    handing its memory back to the host. Returns 0, or -1 if there is no
+ *    such segment.
+ */
+int mem_unmap_segment_r(memlib_t *mem, void *start) {
+    for (mem_segment_t **at = &mem->segments; *at != NULL; at = &(*at)->next) {
+        mem_segment_t *segment = *at;
+        if (segment->start == start) {
+            *at = segment->next;
+            mem->segment_bytes -= segment->size;
+            munmap(segment->start, segment->size);
+            mem_note_size(mem, -segment->size);
+            free(segment);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * mem_segment_next_r - return the start of the first segment of mem after
+ *    the one that starts at prev, in address order, or of the first one if
+ *    prev is NULL, and store its size in size. Returns NULL after the last.
+ */
+void *mem_segment_next_r(memlib_t *mem, void *prev, long *size) {
+    mem_segment_t *s = mem->segments;
+
+    while (s != NULL && prev != NULL && s->start <= (char *)prev) {
+        s = s->next;
+    }
+    if (s == NULL) {
+        return NULL;
+    }
+    *size = s->size;
+    return s->start;
+}
+
+/*
+ * mem_segment_of_r - return the start of the segment of mem that holds ptr,
+ *    storing its size in size, or NULL if ptr is in none
+ */
+void *mem_segment_of_r(memlib_t *mem, void *ptr, long *size) {
+    for (mem_segment_t *s = mem->segments; s != NULL; s = s->next) {
+        if ((char *)ptr >= s->start && (char *)ptr < s->start + s->size) {
+            *size = s->size;
+            return s->start;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * mem_in_heap_r - return whether the bytes from lo to hi, inclusive, all lie
+ *    in mem's heap: below its brk, or in one of its segments
+ */
+int mem_in_heap_r(memlib_t *mem, void *lo, void *hi) {
+    long size;
+    char *segment;
+
+    if ((char *)lo >= mem->mem_start_brk && (char *)hi < mem_get_brk(mem)) {
+        return lo <= hi;
+    }
+    segment = mem_segment_of_r(mem, lo, &size);
+    return segment != NULL && lo <= hi && (char *)hi < segment + size;
+}
+
+/*
+ * mem_checkpoint_r - copy the bytes of mem's heap, and its size, so that
+ *    mem_restore_r can return it to this state. Returns NULL if there is
+ *    no memory for the copy, or the heap has segments, which could not be
+ *    mapped at the same place again. Must not race with calls that change
+ *    the heap.
+ */
+mem_checkpoint_t *mem_checkpoint_r(memlib_t *mem) {
+    long size = mem_get_brk(mem) - mem->mem_start_brk;
+    mem_checkpoint_t *ckpt;
+
+    if (mem->segments != NULL) {
+        errno = ENOTSUP;
+        return NULL;
+    }
+    if ((ckpt = malloc(sizeof(mem_checkpoint_t) + size)) == NULL) {
+        return NULL;
+    }
+    ckpt->size = size;
+    memcpy(ckpt->bytes, mem->mem_start_brk, size);
+    return ckpt;
+}
+
+/*
+ * mem_restore_r - return mem's heap to the state ckpt, taken from the same
+ *    heap, recorded: only the bytes below the recorded brk are copied back,
+ *    as nothing above it is part of the heap any more, and segments mapped
+ *    since are unmapped. Returns 0, or -1 if
+ *    the memory for them could not be committed. Must not race with calls
+ *    that use the heap.
+ */
+int mem_restore_r(memlib_t *mem, mem_checkpoint_t *ckpt) {
+    char *brk = mem->mem_start_brk + ckpt->size;
+
+    if (brk > mem->mem_max_addr || mem_commit(mem, brk) < 0) {
+        return -1;
+    }
+    mem_unmap_segments(mem);
+    memcpy(mem->mem_start_brk, ckpt->bytes, ckpt->size);
+    mem_set_brk(mem, brk);
+    mem->peak_bytes = ckpt->size;
+    return 0;
+}
+
+/*
+ * mem_checkpoint_free - free a copy made by mem_checkpoint_r
+ */
+void mem_checkpoint_free(mem_checkpoint_t *ckpt) { free(ckpt); }
+
+/*
+ * mem_sbrk_chunk - extend mem by size bytes and return that chunk as an
+ *    empty heap of its own, or NULL (with errno set to ENOMEM) if mem or
+ *    the host is out of memory. Each user of a chunk, e.g. one arena,
+ *    then grows its heap inside it without touching mem's brk again. The
+ *    chunk lives until mem_destroy(chunk); its storage is freed with mem.
+ */
+memlib_t *mem_sbrk_chunk(memlib_t *mem, long size) {
+    memlib_t *chunk;
+    char *start;
+
+    if (size < 0 || (chunk = (memlib_t *)malloc(sizeof(memlib_t))) == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if ((start = mem_bump(mem, size)) == NULL) {
+        free(chunk);
+        errno = ENOMEM;
+        return NULL;
+    }
+    chunk->mem_start_brk = start;
+    chunk->mem_brk = start;
+    chunk->mem_max_addr = start + size;
+    chunk->mem_committed = start;  // the chunk commits its own pages
+    chunk->page_size = mem->page_size;
+    chunk->owns_storage = 0;
+    chunk->fd = -1;  // only the parent's size is kept in a file
+    chunk->file_brk = NULL;
+    chunk->segments = NULL;
+    chunk->segment_bytes = 0;
+    chunk->peak_bytes = 0;
+    chunk->sbrk_calls = 0;
+    chunk->growth = NULL;
+    return chunk;
+}
+
+/*
+ * mem_heap_lo_r - return address of the first heap byte
+ */
+void *mem_heap_lo_r(memlib_t *mem) { return (void *)mem->mem_start_brk; }
+
+/*
+ * mem_heap_hi_r - return address of last heap byte
+ */
+void *mem_heap_hi_r(memlib_t *mem) { return (void *)(mem_get_brk(mem) - 1); }
+
+/*
+ * mem_pagesize_r - returns the size of the pages behind the heap, which may
+ *    be huge pages
+ */
+long mem_pagesize_r(memlib_t *mem) { return mem->page_size; }
+
+/*
+ * mem_heap_peak_r - returns the largest size in bytes the heap has had since
+ *    it was last reset; larger than its size if segments were unmapped or
+ *    the top was trimmed since
+ */
+long mem_heap_peak_r(memlib_t *mem) {
+    return __atomic_load_n(&mem->peak_bytes, __ATOMIC_RELAXED);
+}
+
+/*
+ * mem_sbrk_calls_r - returns the number of mem_sbrk_r calls on mem since it
+ *    was last reset, failed ones included
+ */
+long mem_sbrk_calls_r(memlib_t *mem) {
+    return __atomic_load_n(&mem->sbrk_calls, __ATOMIC_RELAXED);
+}
+
+/*
+ * mem_growth_start_r - start logging every change in the size of mem's heap,
+ *    as mem_growth_events_r returns it, dropping any earlier log. Returns 0,
+ *    or -1 if there is no memory for the log. Must not race with calls that
+ *    change the heap.
+ */
+int mem_growth_start_r(memlib_t *mem) {
+    mem_growth_t *growth = malloc(sizeof(mem_growth_t));
+
+    mem_growth_stop_r(mem);
+    if (growth == NULL) {
+        return -1;
+    }
+    growth->events = malloc(MEM_GROWTH_EVENTS * sizeof(mem_growth_event_t));
+    if (growth->events == NULL) {
+        free(growth);
+        return -1;
+    }
+    pthread_mutex_init(&growth->lock, NULL);
+    growth->count = 0;
+    growth->capacity = MEM_GROWTH_EVENTS;
+    growth->op = -1;
+    growth->start_ns = mem_now_ns();
+    mem->growth = growth;
+    return 0;
+}
+
+/*
+ * mem_growth_stop_r - stop logging the growth of mem's heap and free the log
+ */
+void mem_growth_stop_r(memlib_t *mem) {
+    mem_growth_t *growth = mem->growth;
+
+    if (growth != NULL) {
+        mem->growth = NULL;
+        pthread_mutex_destroy(&growth->lock);
+        free(growth->events);
+        free(growth);
+    }
+}
+
+/*
+ * mem_growth_op_r - set the op that the changes logged from now on belong
+ *    to; it is -1 until first set
+ */
+void mem_growth_op_r(memlib_t *mem, long op) {
+    if (mem->growth != NULL) {
+        mem->growth->op = op;
+    }
+}
+
+/*
+ * mem_growth_events_r - return the changes logged since mem_growth_start_r,
+ *    oldest first, and store their number in count. The array stays valid
+ *    until the next change or mem_growth_stop_r. Returns NULL, with a count
+ *    of 0, if mem does not log its growth.
+ */
+const mem_growth_event_t *mem_growth_events_r(memlib_t *mem, long *count) {
+    *count = mem->growth != NULL ? mem->growth->count : 0;
+    return mem->growth != NULL ? mem->growth->events : NULL;
+}
+
+/*
+ * mem_heapsize_r - returns the heap size in bytes, segments included
+ */
+long mem_heapsize_r(memlib_t *mem) {
+    return (long)(mem_get_brk(mem) - mem->mem_start_brk) + mem->segment_bytes;
+}
+
+/*
+ * mem_init - initialize the memory system model, with a heap of at most
+ *    MAX_HEAP bytes
+ */
+void mem_init(void) { mem_init_size(MAX_HEAP); }
+
+/*
+ * mem_init_size - initialize the memory system model, with a heap of at
+ *    most max_heap bytes. Only address space is reserved, so this may be
+ *    far more than the host's memory.
+ */
+void mem_init_size(long max_heap) {
+    if (mem_open(&default_mem, max_heap) < 0) {
+        fprintf(stderr, "mem_init_vm: mmap error\n");
+        exit(1);
+    }
+}
+
+/*
+ * mem_deinit - free the storage used by the memory system model
+ */
+void mem_deinit(void) {
+    mem_growth_stop_r(&default_mem);
+    mem_close(&default_mem);
+}
+
+/*
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ */
+void mem_reset_brk() { mem_reset_brk_r(&default_mem); }
+
+/*
+ * mem_sbrk - mem_sbrk_r on the default heap
+ */
+void *mem_sbrk(long incr) { return mem_sbrk_r(&default_mem, incr); }
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
-void *mem_heap_lo() { return (void *)mem_start_brk; }
+void *mem_heap_lo() { return mem_heap_lo_r(&default_mem); }
 
 /*
  * mem_heap_hi - return address of last heap byte
  */
-void *mem_heap_hi() { return (void *)(mem_brk - 1); }
+void *mem_heap_hi() { return mem_heap_hi_r(&default_mem); }
 
 /*
  * mem_heapsize() - returns the heap size in bytes
  */
-long mem_heapsize() { return (long)(mem_brk - mem_start_brk); }
+long mem_heapsize() { return mem_heapsize_r(&default_mem); }
+
+/*
+ * mem_heap_peak - mem_heap_peak_r on the default heap
+ */
+long mem_heap_peak() { return mem_heap_peak_r(&default_mem); }
+
+/*
+ * mem_sbrk_calls - mem_sbrk_calls_r on the default heap
+ */
+long mem_sbrk_calls() { return mem_sbrk_calls_r(&default_mem); }
+
+/*
+ * mem_growth_start - mem_growth_start_r on the default heap
+ */
+int mem_growth_start() { return mem_growth_start_r(&default_mem); }
+
+/*
+ * mem_growth_op - mem_growth_op_r on the default heap
+ */
+void mem_growth_op(long op) { mem_growth_op_r(&default_mem, op); }
+
+/*
+ * mem_growth_events - mem_growth_events_r on the default heap
+ */
+const mem_growth_event_t *mem_growth_events(long *count) {
+    return mem_growth_events_r(&default_mem, count);
+}
+
+/*
+ * mem_in_heap - mem_in_heap_r on the default heap
+ */
+int mem_in_heap(void *lo, void *hi) {
+    return mem_in_heap_r(&default_mem, lo, hi);
+}
+
+/*
+ * mem_checkpoint - mem_checkpoint_r on the default heap
+ */
+mem_checkpoint_t *mem_checkpoint() { return mem_checkpoint_r(&default_mem); }
+
+/*
+ * mem_restore - mem_restore_r on the default heap
+ */
+int mem_restore(mem_checkpoint_t *ckpt) {
+    return mem_restore_r(&default_mem, ckpt);
+}
 
 /*
  * mem_pagesize() - returns the page size of the system
@@ -3,13 +3,87 @@
 
 #include <unistd.h>
 
+/* one simulated heap; the fields are private to memlib.c */
+typedef struct memlib memlib_t;
+
+/* a copy of a heap's contents, see mem_checkpoint_r */
+typedef struct mem_checkpoint mem_checkpoint_t;
+
+/* the pages behind a heap, see mem_set_pages */
+#define MEM_PAGES_SMALL 0   /* the system's base pages */
+#define MEM_PAGES_THP 1     /* transparent huge pages, madvise(MADV_HUGEPAGE) */
+#define MEM_PAGES_HUGETLB 2 /* explicit huge pages, mmap(MAP_HUGETLB) */
+
+int mem_set_pages(int pages);
+
+/* one change in the size of a heap, see mem_growth_start_r */
+typedef struct {
+    long op;   /* the op it happened at, as set with mem_growth_op_r */
+    long ns;   /* when, in ns since mem_growth_start_r */
+    long incr; /* bytes the heap grew by; negative if it shrank */
+    long size; /* the heap's size afterwards */
+} mem_growth_event_t;
+
+/* single-heap API, operating on the default instance */
 void mem_init(void);
+void mem_init_size(long max_heap);
 void mem_deinit(void);
-void *mem_sbrk(int incr);
+void *mem_sbrk(long incr);
 void mem_reset_brk(void);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 long mem_heapsize(void);
 long mem_pagesize(void);
+int mem_in_heap(void *lo, void *hi);
+long mem_heap_peak(void);
+long mem_sbrk_calls(void);
+int mem_growth_start(void);
+void mem_growth_op(long op);
+const mem_growth_event_t *mem_growth_events(long *count);
+mem_checkpoint_t *mem_checkpoint(void);
+int mem_restore(mem_checkpoint_t *ckpt);
+
+/* reentrant API, operating on an explicit instance */
+memlib_t *mem_create(long max_heap);
+void mem_destroy(memlib_t *mem);
+memlib_t *mem_default(void);
+void *mem_sbrk_r(memlib_t *mem, long incr);
+void mem_reset_brk_r(memlib_t *mem);
+void *mem_heap_lo_r(memlib_t *mem);
+void *mem_heap_hi_r(memlib_t *mem);
+long mem_heapsize_r(memlib_t *mem);
+long mem_pagesize_r(memlib_t *mem);
+int mem_trim_r(memlib_t *mem, long decr);
+long mem_release_r(memlib_t *mem, void *start, void *end);
+long mem_resident_r(memlib_t *mem);
+memlib_t *mem_sbrk_chunk(memlib_t *mem, long size);
+int mem_in_heap_r(memlib_t *mem, void *lo, void *hi);
+long mem_heap_peak_r(memlib_t *mem);
+
+/* the growth profiler */
+long mem_sbrk_calls_r(memlib_t *mem);
+int mem_growth_start_r(memlib_t *mem);
+void mem_growth_stop_r(memlib_t *mem);
+void mem_growth_op_r(memlib_t *mem, long op);
+const mem_growth_event_t *mem_growth_events_r(memlib_t *mem, long *count);
+
+/* segments, which a heap grows by once mem_sbrk_r has no room left */
+long mem_room_r(memlib_t *mem);
+void *mem_map_segment_r(memlib_t *mem, long size);
+int mem_unmap_segment_r(memlib_t *mem, void *start);
+void *mem_segment_next_r(memlib_t *mem, void *prev, long *size);
+void *mem_segment_of_r(memlib_t *mem, void *ptr, long *size);
+mem_checkpoint_t *mem_checkpoint_r(memlib_t *mem);
+int mem_restore_r(memlib_t *mem, mem_checkpoint_t *ckpt);
+void mem_checkpoint_free(mem_checkpoint_t *ckpt);
+
+/*
+ * heaps kept in a file, which later processes can map again, or in shared
+ * memory, which several processes can map at once
+ */
+memlib_t *mem_open_file(const char *path, long max_heap);
+memlib_t *mem_open_shared(const char *name, long max_heap);
+int mem_unlink_shared(const char *name);
+int mem_sync_r(memlib_t *mem);
 
 #endif
@@ -3,19 +3,121 @@
 
 #include <stdio.h>
 
+#include "memlib.h"
+
+/* one independent heap; the fields are private to mm.c */
+typedef struct mm_heap mm_heap_t;
+
+/* how a free block is chosen for a request */
+typedef enum { MM_FIT_FIRST, MM_FIT_BEST } mm_fit_t;
+
+/* when freed blocks are merged with their free neighbours */
+typedef enum { MM_COALESCE_IMMEDIATE, MM_COALESCE_DEFERRED } mm_coalesce_t;
+
+/* a copy of a heap and its memory, see mm_heap_checkpoint */
+typedef struct mm_checkpoint mm_checkpoint_t;
+
+/*
+ * single-heap API, operating on a default heap in memlib's default memory.
+ * Allocation calls may come from any thread (see mmlock.h); init, set_log
+ * and set_copies must not race with them.
+ */
 int mm_init(void);
 void *mm_malloc(long size);
 void mm_free(void *ptr);
 void *mm_realloc(void *ptr, long size);
+int mm_malloc_batch(long size, int n, void **out);
+void mm_free_batch(void **ptrs, int n);
+void mm_set_log(FILE *log);
+void mm_set_copies(int copies);
+int mm_start_maintenance(long interval_us);
+void mm_stop_maintenance(void);
+mm_checkpoint_t *mm_checkpoint(void);
+int mm_restore(mm_checkpoint_t *ckpt);
+
+/*
+ * reentrant API, operating on an explicit heap. As above, every call but
+ * create, destroy, init, set_log and set_copies may come from several
+ * threads at once.
+ */
+mm_heap_t *mm_heap_create(memlib_t *mem);
+void mm_heap_destroy(mm_heap_t *heap);
+int mm_heap_init(mm_heap_t *heap);
+void *mm_heap_malloc(mm_heap_t *heap, long size);
+int mm_heap_try_malloc(mm_heap_t *heap, long size, void **ptr);
+void mm_heap_free(mm_heap_t *heap, void *ptr);
+void *mm_heap_realloc(mm_heap_t *heap, void *ptr, long size);
+int mm_heap_malloc_batch(mm_heap_t *heap, long size, int n, void **out);
+void mm_heap_free_batch(mm_heap_t *heap, void **ptrs, int n);
+void mm_heap_set_policy(mm_heap_t *heap, mm_fit_t fit, mm_coalesce_t coalesce,
+                        int adaptive);
+void mm_heap_set_log(mm_heap_t *heap, FILE *log);
+void mm_heap_set_copies(mm_heap_t *heap, int copies);
+
+/*
+ * checkpoints of a heap, which it can be set back to any number of times,
+ * e.g. to time the same calls again without repeating the ones that led up
+ * to them. Taking or restoring one must not race with other calls on the
+ * heap, and blocks in the thread caches of other threads are not part of
+ * it. A shared heap cannot be restored while other processes use it.
+ */
+mm_checkpoint_t *mm_heap_checkpoint(mm_heap_t *heap);
+int mm_heap_restore(mm_heap_t *heap, mm_checkpoint_t *ckpt);
+void mm_checkpoint_free(mm_checkpoint_t *ckpt);
+
+/*
+ * an optional thread per heap that merges, trims and flushes thread caches
+ * while the heap is idle, so that calls do not have to (see mm.c). Builds
+ * with -D MM_MAINT=0, the default for MM_LOCK=0, leave it out entirely and
+ * start always fails.
+ */
+int mm_heap_start_maintenance(mm_heap_t *heap, long interval_us);
+void mm_heap_stop_maintenance(mm_heap_t *heap);
+long mm_heap_maintenance_passes(mm_heap_t *heap);
+
+/*
+ * persistent heaps, kept in a file opened with mem_open_file and reopened as
+ * they were left (see mm.c). Only builds with -D MM_OFFSETS=1 and neither
+ * MM_CLASS_LOCKS, MM_TCACHE nor MM_SIZE_INDEX have them; in any other,
+ * mm_heap_open always fails. The root is one block that the program finds
+ * its data from after a reopen. A heap in shared memory (mem_open_shared)
+ * opened with MM_PERSIST_SHARED by several processes at once is one heap
+ * to all of them, guarded by a lock in the heap itself; it must have been
+ * created, by the first open, before any other process opens it. Blocks are
+ * passed between processes as offsets (mm_heap_offset), since each maps the
+ * heap at its own address.
+ */
+#define MM_PERSIST_CRASH_SAFE 1 /* keep the heap reopenable between calls */
+#define MM_PERSIST_SHARED 2     /* share the heap with other processes */
+mm_heap_t *mm_heap_open(memlib_t *mem, int flags);
+int mm_heap_close(mm_heap_t *heap);
+int mm_heap_sync(mm_heap_t *heap);
+void mm_heap_set_root(mm_heap_t *heap, void *ptr);
+void *mm_heap_root(mm_heap_t *heap);
+long mm_heap_offset(mm_heap_t *heap, void *ptr);
+void *mm_heap_pointer(mm_heap_t *heap, long offset);
 
 // Defines alignment to 8 bytes.
 #define ALIGNMENT 8
 // Size of a memory address, which in this case is 8 bytes
 // in a 64-bit system.
-#define WORD_SIZE (long)(sizeof(long))  //returns an unsigned, which is why we cast
+#define WORD_SIZE \
+    (long)(sizeof(long))  // returns an unsigned, which is why we cast
 // Sum of the sizes of the beginning and end tags of a block.
 // (Each tag's size is WORD_SIZE)
 #define TAGS_SIZE (long)(2 * WORD_SIZE)
+// Whether allocated blocks keep an end tag. Building with -D MM_FOOTERS=0
+// elides it, so an allocated block only needs WORD_SIZE bytes of tags.
+#ifndef MM_FOOTERS
+#define MM_FOOTERS 1
+#endif
+// Whether free blocks link to each other by offset. Building with
+// -D MM_OFFSETS=1 stores each link as the distance from the block to the one
+// it points to, so a heap stays valid wherever its memory is mapped (see
+// mm_heap_open).
+#ifndef MM_OFFSETS
+#define MM_OFFSETS 0
+#endif
 // Minimum size of a block. Your implementation should make
 // sure no allocated or free block has a size of less than
 // this constant.
@@ -32,7 +134,9 @@ typedef struct block {
     // for free blocks:
     //     payload[0] is the block's flink (the next block in the free list)
     //     payload[1] is the block's blink (the previous block in the free list)
-    // there is a copy of the size field at the end of the block
+    //     (with MM_OFFSETS, each as an offset from the block)
+    // there is a copy of the size field at the end of the block (for an
+    // allocated block, only if MM_FOOTERS is set)
 } block_t;
 
 #endif  // MM_H_
@@ -0,0 +1,282 @@
+/*
+ * mmarena.c - several heaps that threads allocate from side by side. See
+ *             mmarena.h for how threads are spread over the arenas.
+ */
+#include "mmarena.h"
+
+#include <stdlib.h>
+
+#define DRAIN_INTERVAL 32  // mallocs between looks at the remote stacks
+
+/*
+ * The blocks freed to an arena by threads that allocate elsewhere, as a
+ * Treiber stack linked through the first word of each payload. Any thread
+ * pushes with a CAS; the arena's own threads take the whole stack at once
+ * with an exchange, so no block is ever popped on its own and ABA cannot
+ * happen. Each stack has a cache line to itself, shared only with its counts,
+ * which are updated right after the head by whoever just wrote it.
+ */
+typedef struct {
+    void *head;
+    long pushes;  // blocks ever pushed
+    long drains;  // times the stack was taken
+} __attribute__((aligned(64))) remote_stack_t;
+
+struct mm_arenas {
+    long id;                 // unique among all sets ever created
+    int count;               // number of arenas
+    long size;               // bytes of simulated memory per arena
+    memlib_t *region;        // the memory all arenas are carved from
+    char *base;              // its first byte; arena i starts i * size later
+    memlib_t **mems;         // the chunk of region owned by each arena ...
+    mm_heap_t **heaps;       // ... and the heap in it
+    int next;                // arena given to the next new thread
+    long moves;              // times a thread moved on from a busy arena
+    int remote_queues;       // whether remote frees go through the stacks
+    remote_stack_t *remote;  // the remote frees of each arena
+};
+
+static long last_id;  // the id of the set created last
+
+/*
+ * the arena the calling thread allocates from. A set may be freed and a new
+ * one created at the same address, so the set is recognized by its id too.
+ */
+static __thread struct {
+    mm_arenas_t *arenas;  // the set it belongs to, or NULL
+    long id;              // that set's id
+    int index;
+    int mallocs;       // mallocs since the remote stacks were last looked at
+    long next_drains;  // drains of the next arena's stack at that look
+} current;
+
+/*
+ * mm_arenas_create - create count arenas of arena_size bytes each, as
+ *     consecutive chunks of one simulated region. Returns NULL if the memory
+ *     could not be allocated.
+ */
+mm_arenas_t *mm_arenas_create(int count, long arena_size) {
+    mm_arenas_t *arenas = calloc(1, sizeof(mm_arenas_t));
+
+    if (arenas == NULL) {
+        return NULL;
+    }
+    arenas->id = __atomic_add_fetch(&last_id, 1, __ATOMIC_RELAXED);
+    arenas->size = arena_size;
+    arenas->remote_queues = 1;
+    arenas->mems = calloc(count, sizeof(memlib_t *));
+    arenas->heaps = calloc(count, sizeof(mm_heap_t *));
+    arenas->region = mem_create((long)count * arena_size);
+    if (posix_memalign((void **)&arenas->remote, sizeof(remote_stack_t),
+                       count * sizeof(remote_stack_t)) != 0) {
+        arenas->remote = NULL;
+    }
+    if (arenas->mems == NULL || arenas->heaps == NULL ||
+        arenas->region == NULL || arenas->remote == NULL) {
+        mm_arenas_destroy(arenas);
+        return NULL;
+    }
+    arenas->base = mem_heap_lo_r(arenas->region);
+    for (; arenas->count < count; arenas->count++) {
+        int i = arenas->count;
+        if ((arenas->mems[i] = mem_sbrk_chunk(arenas->region, arena_size)) ==
+            NULL) {
+            mm_arenas_destroy(arenas);
+            return NULL;
+        }
+        arenas->remote[i].head = NULL;
+        arenas->remote[i].pushes = 0;
+        arenas->remote[i].drains = 0;
+        if ((arenas->heaps[i] = mm_heap_create(arenas->mems[i])) == NULL) {
+            mem_destroy(arenas->mems[i]);
+            mm_arenas_destroy(arenas);
+            return NULL;
+        }
+    }
+    return arenas;
+}
+
+/*
+ * drain - take an arena's whole remote stack and free its blocks. They are
+ *     freed one by one: they come back in no particular order, and sorting
+ *     them for mm_heap_free_batch costs more than it saves.
+ */
+static void drain(mm_arenas_t *arenas, int i) {
+    void *ptr =
+        __atomic_exchange_n(&arenas->remote[i].head, NULL, __ATOMIC_ACQUIRE);
+
+    __atomic_add_fetch(&arenas->remote[i].drains, 1, __ATOMIC_RELAXED);
+    while (ptr != NULL) {
+        void *next = *(void **)ptr;
+        mm_heap_free(arenas->heaps[i], ptr);
+        ptr = next;
+    }
+}
+
+/*
+ * drain_next - drain the remote stack of the arena after the calling thread's
+ *     if nobody has drained it since this thread last looked at it: no thread
+ *     may be left on that arena to do it.
+ */
+static void drain_next(mm_arenas_t *arenas) {
+    int i = (current.index + 1) % arenas->count;
+    long drains = __atomic_load_n(&arenas->remote[i].drains, __ATOMIC_RELAXED);
+
+    if (i == current.index) {
+        return;
+    }
+    if (drains == current.next_drains &&
+        __atomic_load_n(&arenas->remote[i].head, __ATOMIC_RELAXED) != NULL) {
+        drain(arenas, i);
+        drains++;
+    }
+    current.next_drains = drains;
+}
+
+/*
+ * mm_arenas_destroy - free every arena. No thread may use them any more.
+ */
+void mm_arenas_destroy(mm_arenas_t *arenas) {
+    for (int i = 0; i < arenas->count; i++) {
+        drain(arenas, i);
+    }
+    for (int i = 0; i < arenas->count; i++) {
+        mm_heap_destroy(arenas->heaps[i]);
+        mem_destroy(arenas->mems[i]);
+    }
+    if (arenas->region != NULL) {
+        mem_destroy(arenas->region);
+    }
+    free(arenas->mems);
+    free(arenas->heaps);
+    free(arenas->remote);
+    free(arenas);
+}
+
+/*
+ * owner - return the index of the arena whose chunk holds ptr, or -1. The
+ *     chunks were taken in order and are all the same size.
+ */
+static int owner(mm_arenas_t *arenas, void *ptr) {
+    if ((char *)ptr < arenas->base ||
+        (char *)ptr >= arenas->base + (long)arenas->count * arenas->size) {
+        return -1;
+    }
+    return (int)(((char *)ptr - arenas->base) / arenas->size);
+}
+
+/*
+ * is_current - return whether the calling thread's arena is one of this set
+ */
+static inline int is_current(mm_arenas_t *arenas) {
+    return current.arenas == arenas && current.id == arenas->id &&
+           current.index < arenas->count;
+}
+
+/*
+ * mm_arenas_malloc - allocate from the calling thread's arena. If another
+ *     thread holds its lock, try the following arenas in turn and stay on
+ *     the first one that is free; if all are busy, wait for the last one.
+ */
+void *mm_arenas_malloc(mm_arenas_t *arenas, long size) {
+    void *ptr;
+
+    if (!is_current(arenas)) {
+        current.arenas = arenas;
+        current.id = arenas->id;
+        current.mallocs = 0;
+        current.index = __atomic_fetch_add(&arenas->next, 1, __ATOMIC_RELAXED) %
+                        arenas->count;
+    }
+    // the stacks are only looked at every DRAIN_INTERVAL mallocs, which
+    // keeps their lines out of the common path and lets blocks pile up
+    // into longer runs of frees under one lock
+    if (++current.mallocs >= DRAIN_INTERVAL) {
+        current.mallocs = 0;
+        if (__atomic_load_n(&arenas->remote[current.index].head,
+                            __ATOMIC_RELAXED) != NULL) {
+            drain(arenas, current.index);
+        }
+        drain_next(arenas);
+    }
+    for (int tries = 1; tries < arenas->count; tries++) {
+        if (mm_heap_try_malloc(arenas->heaps[current.index], size, &ptr)) {
+            return ptr;
+        }
+        current.index = (current.index + 1) % arenas->count;
+        __atomic_add_fetch(&arenas->moves, 1, __ATOMIC_RELAXED);
+    }
+    return mm_heap_malloc(arenas->heaps[current.index], size);
+}
+
+/*
+ * mm_arenas_free - free a block to the arena it was allocated from. A block
+ *     of the calling thread's own arena is freed at once. With remote queues
+ *     on, any other block is pushed onto its arena's remote stack, to be
+ *     freed by that arena's next malloc, instead of taking its lock.
+ */
+void mm_arenas_free(mm_arenas_t *arenas, void *ptr) {
+    int i;
+
+    if (ptr == NULL || (i = owner(arenas, ptr)) < 0) {
+        return;
+    }
+    if (!arenas->remote_queues || (is_current(arenas) && current.index == i)) {
+        mm_heap_free(arenas->heaps[i], ptr);
+        return;
+    }
+    void *head = __atomic_load_n(&arenas->remote[i].head, __ATOMIC_RELAXED);
+    do {
+        *(void **)ptr = head;
+    } while (!__atomic_compare_exchange_n(&arenas->remote[i].head, &head, ptr,
+                                          1, __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+    __atomic_add_fetch(&arenas->remote[i].pushes, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * mm_arenas_set_remote_queues - choose whether frees from threads of other
+ *     arenas go through the remote stacks (enabled) or take the owning
+ *     arena's lock. Must not race with frees; the default is enabled.
+ */
+void mm_arenas_set_remote_queues(mm_arenas_t *arenas, int enabled) {
+    arenas->remote_queues = enabled;
+}
+
+/*
+ * mm_arenas_realloc - resize a block within the arena it was allocated from
+ */
+void *mm_arenas_realloc(mm_arenas_t *arenas, void *ptr, long size) {
+    int i;
+
+    if (ptr == NULL) {
+        return mm_arenas_malloc(arenas, size);
+    }
+    if ((i = owner(arenas, ptr)) < 0) {
+        return NULL;
+    }
+    // the block is live, so it is on no remote stack; only the heap's lock
+    // is needed
+    return mm_heap_realloc(arenas->heaps[i], ptr, size);
+}
+
+/*
+ * mm_arenas_moves - return the number of times a thread moved on from a busy
+ *     arena
+ */
+long mm_arenas_moves(mm_arenas_t *arenas) {
+    return __atomic_load_n(&arenas->moves, __ATOMIC_RELAXED);
+}
+
+/*
+ * mm_arenas_remote_frees - return the number of blocks freed through the
+ *     remote stacks
+ */
+long mm_arenas_remote_frees(mm_arenas_t *arenas) {
+    long frees = 0;
+
+    for (int i = 0; i < arenas->count; i++) {
+        frees += __atomic_load_n(&arenas->remote[i].pushes, __ATOMIC_RELAXED);
+    }
+    return frees;
+}
@@ -0,0 +1,31 @@
+#ifndef MMARENA_H_
+#define MMARENA_H_
+
+#include "mm.h"
+
+/*
+ * A set of arenas: independent heaps, each in its own chunk of one simulated
+ * memory region and with its own lock, that threads allocate from side by side.
+ * A thread is given an arena round-robin on its first call and moves on to
+ * another one whenever its arena's lock is held by someone else. A block is
+ * always freed to the arena it came from, which is found from its address.
+ * Blocks freed by threads of other arenas wait on a lock-free stack until a
+ * later malloc of the owning arena frees them. A stack that no thread drains
+ * for a while is drained by the threads of the arena before it, and
+ * destroying the set frees whatever is left.
+ */
+typedef struct mm_arenas mm_arenas_t;
+
+mm_arenas_t *mm_arenas_create(int count, long arena_size);
+void mm_arenas_destroy(mm_arenas_t *arenas);
+void *mm_arenas_malloc(mm_arenas_t *arenas, long size);
+void mm_arenas_free(mm_arenas_t *arenas, void *ptr);
+void *mm_arenas_realloc(mm_arenas_t *arenas, void *ptr, long size);
+void mm_arenas_set_remote_queues(mm_arenas_t *arenas, int enabled);
+
+/* the number of times a thread moved to another arena */
+long mm_arenas_moves(mm_arenas_t *arenas);
+/* the number of blocks freed through the remote stacks */
+long mm_arenas_remote_frees(mm_arenas_t *arenas);
+
+#endif  // MMARENA_H_
@@ -0,0 +1,1232 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "./memlib.h"
+#include "fsecs.h"
+#include "mm.h"
+#include "mmarena.h"
+#include "mmindex.h"
+#include "mminline.h"
+
+#define USAGE                                                         \
+    "./mmbench <all | names of benchmarks to run>"                    \
+    "\n   Ex. \"./mmbench all\" runs all benchmarks"                  \
+    "\n   Ex. \"./mmbench batch\" runs the batch benchmark"           \
+    "\n   Possible benchmarks: 'batch', 'heaps', 'index', 'arenas', " \
+    "'larson', 'threadtest', 'xmalloc', 'scratch', 'persist', 'shared'"
+
+#define BATCH_OBJS (1 << 16) /* objects allocated per timed run */
+#define BATCH_MAX 1024       /* largest batch that is measured */
+#define BATCH_OBJ_SIZE 48    /* payload size of every batched object */
+#define FRAGMENT_BLOCKS 2000 /* blocks used to fragment the heap first */
+#define HEAPS_MAX 8          /* most heaps run side by side */
+#define HEAPS_OPS 200000     /* operations per timed run, over all heaps */
+#define HEAPS_LIVE 512       /* live objects kept per heap */
+#define HEAPS_MEM (4 << 20)  /* simulated memory per heap */
+#define INDEX_MAX 4096       /* longest free list that is searched */
+#define INDEX_SEARCHES 4096  /* searches per timed run */
+#define INDEX_MEM (1 << 20)  /* simulated memory for the searched blocks */
+#define INDEX_MALLOCS 1024   /* mallocs per timed run */
+#define INDEX_SMALL 16       /* payload of the blocks a malloc passes over */
+#define INDEX_LARGE 64       /* ... and of the ones it takes */
+#define ARENAS_MAX 8         /* most arenas the pairs share */
+#define ARENAS_PAIRS 4       /* producer/consumer thread pairs */
+#define ARENAS_OBJS                                                          \
+    (1 << 16)                /* objects passed per timed run, over all pairs \
+                              */
+#define ARENAS_MEM (8 << 20) /* simulated memory per arena */
+#define RING_SIZE 256        /* pointers in flight between one pair */
+#define PAIRS_MAX 4          /* most producer/consumer pairs at once */
+#define STRESS_MAX 8         /* most threads of a stress benchmark */
+#define STRESS_SLOTS 4096    /* most objects one stress thread keeps */
+#define LARSON_SLOTS 1024    /* live objects per larson thread */
+#define LARSON_OPS 200000    /* replacements per timed run, over all threads */
+#define LARSON_ROUNDS 4      /* thread generations per timed run */
+#define LARSON_MAX_SIZE 256  /* largest larson object */
+#define THREADTEST_OBJS 4096 /* objects live at once, over all threads */
+#define THREADTEST_ROUNDS 32 /* times they are allocated and freed */
+#define THREADTEST_SIZE 64   /* payload size of every threadtest object */
+#define XMALLOC_OBJS (1 << 16) /* objects passed per timed run */
+#define SCRATCH_OBJS 4096      /* objects each scratch thread keeps */
+#define SCRATCH_WRITES 64      /* writes to each of them */
+#define SCRATCH_SIZE 8         /* payload size of every scratch object */
+#define CACHE_LINE 64          /* bytes per cache line, assumed */
+#define PERSIST_NODES 200000   /* nodes in the persisted tree */
+#define PERSIST_MEM (64 << 20) /* bytes of heap in the heap file */
+#define PERSIST_FILE "/tmp/mmbench-persist.heap"
+#define SHARED_BYTES (32 << 20) /* message bytes passed per timed run */
+#define SHARED_MIN 256          /* smallest message size measured */
+#define SHARED_MAX (64 << 10)   /* largest message size measured */
+#define SHARED_MEM (64 << 20)   /* bytes of shared heap */
+#define SHARED_NAME "/mmbench-shared"
+
+int verbose = 0; /* needed by fsecs.c */
+
+/* Parameters handed to the timed functions through fsecs */
+typedef struct {
+    int n;       /* objects per round */
+    int batched; /* use the batch API rather than one call per object */
+} batch_params_t;
+
+static void *batch_ptrs[BATCH_MAX];
+
+/*
+ * fragment_heap - resets the heap and leaves a free list of mixed-size holes
+ * behind, so that single-object calls have to search like they would in a
+ * long-running program
+ */
+static void fragment_heap(void) {
+    static void *blocks[FRAGMENT_BLOCKS];
+
+    mem_reset_brk();
+    if (mm_init() < 0) {
+        fprintf(stderr, "mm_init failed\n");
+        exit(1);
+    }
+    srand(330);
+    for (int i = 0; i < FRAGMENT_BLOCKS; i++) {
+        blocks[i] = mm_malloc(16 + rand() % 112);
+    }
+    for (int i = 0; i < FRAGMENT_BLOCKS; i += 2) {
+        mm_free(blocks[i]);
+    }
+}
+
+/*
+ * batch_run - the function timed by fsecs: allocates and frees n objects
+ * BATCH_OBJS / n times, either one at a time or through the batch API
+ */
+static void batch_run(void *argp) {
+    batch_params_t *params = argp;
+    int n = params->n;
+
+    fragment_heap();
+    for (int round = 0; round < BATCH_OBJS / n; round++) {
+        if (params->batched) {
+            if (mm_malloc_batch(BATCH_OBJ_SIZE, n, batch_ptrs) != n) {
+                fprintf(stderr, "mm_malloc_batch failed\n");
+                exit(1);
+            }
+            mm_free_batch(batch_ptrs, n);
+        } else {
+            for (int i = 0; i < n; i++) {
+                if ((batch_ptrs[i] = mm_malloc(BATCH_OBJ_SIZE)) == NULL) {
+                    fprintf(stderr, "mm_malloc failed\n");
+                    exit(1);
+                }
+            }
+            for (int i = 0; i < n; i++) {
+                mm_free(batch_ptrs[i]);
+            }
+        }
+    }
+}
+
+// an empty run, timed to subtract the cost of fragment_heap
+static void batch_setup_only(void *argp) {
+    (void)argp;
+    fragment_heap();
+}
+
+/*
+ * batch_bench - compares the per-object cost of mm_malloc/mm_free against
+ * mm_malloc_batch/mm_free_batch for several batch sizes
+ */
+void batch_bench() {
+    static const int sizes[] = {8, 64, 256, BATCH_MAX};
+    double setup = fsecs(batch_setup_only, NULL);
+
+    printf("batch: %d-byte objects, %d allocated and freed per run\n",
+           BATCH_OBJ_SIZE, BATCH_OBJS);
+    printf("%8s %14s %14s %9s\n", "n", "single ns/obj", "batch ns/obj",
+           "speedup");
+    for (unsigned i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        batch_params_t single = {sizes[i], 0};
+        batch_params_t batched = {sizes[i], 1};
+        double objs = (double)(BATCH_OBJS / sizes[i] * sizes[i]);
+        double t_single = (fsecs(batch_run, &single) - setup) / objs * 1e9;
+        double t_batch = (fsecs(batch_run, &batched) - setup) / objs * 1e9;
+        printf("%8d %14.1f %14.1f %8.2fx\n", sizes[i], t_single, t_batch,
+               t_single / t_batch);
+    }
+}
+
+/* Parameters handed to heaps_run through fsecs */
+typedef struct {
+    int num_heaps;
+    memlib_t *mems[HEAPS_MAX];
+    mm_heap_t *heaps[HEAPS_MAX];
+    void *live[HEAPS_MAX][HEAPS_LIVE];
+} heaps_params_t;
+
+/*
+ * heaps_run - the function timed by fsecs: runs a random malloc/free/realloc
+ * mix, sending each operation to the next heap in turn
+ */
+static void heaps_run(void *argp) {
+    heaps_params_t *params = argp;
+
+    srand(330);
+    for (int h = 0; h < params->num_heaps; h++) {
+        mem_reset_brk_r(params->mems[h]);
+        if (mm_heap_init(params->heaps[h]) < 0) {
+            fprintf(stderr, "mm_heap_init failed\n");
+            exit(1);
+        }
+        memset(params->live[h], 0, sizeof(params->live[h]));
+    }
+    for (int op = 0; op < HEAPS_OPS; op++) {
+        int h = op % params->num_heaps;
+        void **slot = &params->live[h][rand() % HEAPS_LIVE];
+        long size = 8 + rand() % 1024;
+
+        if (*slot == NULL) {
+            *slot = mm_heap_malloc(params->heaps[h], size);
+        } else if (rand() % 4 == 0) {
+            *slot = mm_heap_realloc(params->heaps[h], *slot, size);
+        } else {
+            mm_heap_free(params->heaps[h], *slot);
+            *slot = NULL;
+        }
+    }
+}
+
+/*
+ * heaps_bench - runs the same workload on 1 to HEAPS_MAX independent heaps
+ * side by side in this process and reports their speed and final sizes
+ */
+void heaps_bench() {
+    static heaps_params_t params;
+
+    for (int h = 0; h < HEAPS_MAX; h++) {
+        if ((params.mems[h] = mem_create(HEAPS_MEM)) == NULL ||
+            (params.heaps[h] = mm_heap_create(params.mems[h])) == NULL) {
+            fprintf(stderr, "could not create heap %d\n", h);
+            exit(1);
+        }
+    }
+    printf("heaps: %d random ops spread over independent heaps\n", HEAPS_OPS);
+    printf("%8s %10s %16s\n", "heaps", "ns/op", "avg heap bytes");
+    for (int n = 1; n <= HEAPS_MAX; n *= 2) {
+        long total = 0;
+        params.num_heaps = n;
+        double secs = fsecs(heaps_run, &params);
+        for (int h = 0; h < n; h++) {
+            total += mem_heapsize_r(params.mems[h]);
+        }
+        printf("%8d %10.1f %16ld\n", n, secs / HEAPS_OPS * 1e9, total / n);
+    }
+    for (int h = 0; h < HEAPS_MAX; h++) {
+        mm_heap_destroy(params.heaps[h]);
+        mem_destroy(params.mems[h]);
+    }
+}
+
+/* Parameters handed to index_run through fsecs */
+typedef struct {
+    const char *isa;       /* kernels to scan with, or NULL to walk the list */
+    block_t *head;         /* the free list */
+    char *base;            /* base address of the index offsets */
+    size_index_t idx;      /* the index over the same blocks */
+    mm_heap_t *heap;       /* a heap whose free list is laid out alike ... */
+    mm_checkpoint_t *ckpt; /* ... as saved, before any timed malloc */
+    int mallocs;           /* mallocs per timed run */
+} index_params_t;
+
+/*
+ * index_run - the function timed by fsecs: looks for the one block on the
+ * list that fits, by walking the list or by scanning the index
+ */
+static void index_run(void *argp) {
+    index_params_t *params = argp;
+    long need = 2 * MINBLOCKSIZE;
+    long searched = 0;
+    block_t *fit = NULL;
+
+    for (int i = 0; i < INDEX_SEARCHES; i++) {
+        if (params->isa == NULL) {
+            block_t *b = params->head;
+            do {
+                if (block_size(b) >= need) {
+                    fit = b;
+                    break;
+                }
+                b = block_flink(b);
+            } while (b != params->head);
+        } else {
+            fit = size_index_first_fit(&params->idx, params->base, need,
+                                       &searched);
+        }
+        if (fit == NULL) {
+            fprintf(stderr, "index search failed\n");
+            exit(1);
+        }
+    }
+}
+
+/*
+ * index_malloc_run - the function timed by fsecs: sets the heap back to its
+ * checkpoint and makes mallocs that each take the oldest free block
+ */
+static void index_malloc_run(void *argp) {
+    index_params_t *params = argp;
+
+    if (mm_heap_restore(params->heap, params->ckpt) < 0) {
+        fprintf(stderr, "mm_heap_restore failed\n");
+        exit(1);
+    }
+    for (int i = 0; i < params->mallocs; i++) {
+        if (mm_heap_malloc(params->heap, INDEX_LARGE) == NULL) {
+            fprintf(stderr, "mm_heap_malloc failed\n");
+            exit(1);
+        }
+    }
+}
+
+/*
+ * index_heap - sets up a heap whose free list holds n small blocks, in
+ * shuffled address order, in front of INDEX_MALLOCS blocks that fit a
+ * malloc of INDEX_LARGE exactly, and checkpoints it. Every free block lies
+ * between allocated ones, so none of them is merged.
+ */
+static void index_heap(index_params_t *params, memlib_t *mem, int n) {
+    static void *small[INDEX_MAX], *large[INDEX_MALLOCS];
+
+    if (params->heap != NULL) {
+        mm_checkpoint_free(params->ckpt);
+        mm_heap_destroy(params->heap);
+    }
+    mem_reset_brk_r(mem);
+    if ((params->heap = mm_heap_create(mem)) == NULL) {
+        fprintf(stderr, "mm_heap_create failed\n");
+        exit(1);
+    }
+    mm_heap_set_policy(params->heap, MM_FIT_FIRST, MM_COALESCE_IMMEDIATE, 0);
+    for (int i = 0; i < INDEX_MALLOCS + n; i++) {
+        void **p = i < INDEX_MALLOCS ? &large[i] : &small[i - INDEX_MALLOCS];
+        *p = mm_heap_malloc(params->heap,
+                            i < INDEX_MALLOCS ? INDEX_LARGE : INDEX_SMALL);
+        if (*p == NULL || mm_heap_malloc(params->heap, INDEX_SMALL) == NULL) {
+            fprintf(stderr, "mm_heap_malloc failed\n");
+            exit(1);
+        }
+    }
+    // freed first, the large blocks end up behind the small ones
+    for (int i = 0; i < INDEX_MALLOCS; i++) {
+        mm_heap_free(params->heap, large[i]);
+    }
+    srand(330);
+    for (int i = n - 1; i > 0; i--) {
+        int j = rand() % (i + 1);
+        void *tmp = small[i];
+        small[i] = small[j];
+        small[j] = tmp;
+    }
+    for (int i = 0; i < n; i++) {
+        mm_heap_free(params->heap, small[i]);
+    }
+    if ((params->ckpt = mm_heap_checkpoint(params->heap)) == NULL) {
+        fprintf(stderr, "mm_heap_checkpoint failed\n");
+        exit(1);
+    }
+}
+
+/*
+ * index_bench - compares the cost of one first-fit search that walks the
+ * free list against scans of the packed size index, for lists of several
+ * lengths. The free blocks are linked in shuffled address order, so the walk
+ * takes the cache misses it would in a fragmented heap, and only the last
+ * block on the list (and in the index) is large enough. The last column is
+ * the cost of a whole mm_heap_malloc that has to pass as many free blocks,
+ * which scans the index in mmbench-index and walks the list otherwise.
+ */
+void index_bench() {
+    static const char *isas[] = {"scalar", "sse4.1", "avx2"};
+    static block_t *blocks[INDEX_MAX];
+    static index_params_t params;
+    const char *chosen = size_index_isa();
+    memlib_t *mem = mem_create(INDEX_MEM);
+    memlib_t *heap_mem = mem_create(INDEX_MEM);
+    char *base;
+
+    if (mem == NULL || heap_mem == NULL ||
+        (base = mem_sbrk_r(mem, INDEX_MEM)) == (void *)-1) {
+        fprintf(stderr, "could not create the index heap\n");
+        exit(1);
+    }
+    params.base = base;
+    size_index_init(&params.idx);
+    printf(
+        "index: first-fit search for the last of n free blocks "
+        "(kernels picked: %s)\n",
+        chosen);
+    printf("%8s %12s", "n", "walk ns");
+    for (unsigned k = 0; k < sizeof(isas) / sizeof(isas[0]); k++) {
+        printf(" %12s", isas[k]);
+    }
+    printf(" %12s\n", "malloc ns");
+    for (int len = 16; len <= INDEX_MAX; len *= 4) {
+        // free blocks of MINBLOCKSIZE, each followed by an allocated spacer
+        srand(330);
+        for (int i = 0; i < len; i++) {
+            blocks[i] = (block_t *)(base + 2 * i * MINBLOCKSIZE);
+        }
+        for (int i = len - 1; i > 0; i--) {
+            int j = rand() % (i + 1);
+            block_t *tmp = blocks[i];
+            blocks[i] = blocks[j];
+            blocks[j] = tmp;
+        }
+        params.head = NULL;
+        size_index_clear(&params.idx);
+        // both put a block at the head, so insert in reverse order
+        for (int i = len - 1; i >= 0; i--) {
+            long size = i == len - 1 ? 2 * MINBLOCKSIZE : MINBLOCKSIZE;
+            block_init(blocks[i], size, 0, 1);
+            size_index_insert(&params.idx, base, blocks[i]);
+            flist_insert(&params.head, blocks[i]);
+        }
+        params.isa = NULL;
+        printf("%8d %12.1f", len,
+               fsecs(index_run, &params) / INDEX_SEARCHES * 1e9);
+        for (unsigned k = 0; k < sizeof(isas) / sizeof(isas[0]); k++) {
+            if (size_index_set_isa(isas[k]) < 0) {
+                printf(" %12s", "n/a");
+                continue;
+            }
+            params.isa = isas[k];
+            printf(" %12.1f", fsecs(index_run, &params) / INDEX_SEARCHES * 1e9);
+        }
+        size_index_set_isa(chosen);
+        // the restore alone is timed as well, and taken off
+        index_heap(&params, heap_mem, len);
+        params.mallocs = 0;
+        double restore = fsecs(index_malloc_run, &params);
+        params.mallocs = INDEX_MALLOCS;
+        printf(" %12.1f\n", (fsecs(index_malloc_run, &params) - restore) /
+                                INDEX_MALLOCS * 1e9);
+    }
+    size_index_destroy(&params.idx);
+    mm_checkpoint_free(params.ckpt);
+    mm_heap_destroy(params.heap);
+    mem_destroy(heap_mem);
+    mem_destroy(mem);
+}
+
+/* A single-producer, single-consumer queue of pointers */
+typedef struct {
+    void *slots[RING_SIZE];
+    unsigned head; /* next slot to take, written by the consumer */
+    unsigned tail; /* next slot to fill, written by the producer */
+} ring_t;
+
+/* Parameters of one producer or consumer thread */
+typedef struct {
+    mm_arenas_t *arenas; /* where objects come from; NULL: the default heap */
+    ring_t *ring;
+    int objs; /* objects to pass through the ring */
+} pc_params_t;
+
+// the producer: allocates objects and queues them for its consumer
+static void *producer(void *argp) {
+    pc_params_t *params = argp;
+    ring_t *ring = params->ring;
+    unsigned seed = (unsigned)(size_t)ring;
+
+    for (int i = 0; i < params->objs; i++) {
+        long size = 16 + rand_r(&seed) % 240;
+        char *p = params->arenas ? mm_arenas_malloc(params->arenas, size)
+                                 : mm_malloc(size);
+        if (p == NULL) {
+            fprintf(stderr, "producer: malloc failed\n");
+            exit(1);
+        }
+        p[0] = (char)i;
+        while (ring->tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+               RING_SIZE) {
+            sched_yield();
+        }
+        ring->slots[ring->tail % RING_SIZE] = p;
+        __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+// the consumer: frees the objects its producer queued, in order
+static void *consumer(void *argp) {
+    pc_params_t *params = argp;
+    ring_t *ring = params->ring;
+
+    for (int i = 0; i < params->objs; i++) {
+        while (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ring->head) {
+            sched_yield();
+        }
+        char *p = ring->slots[ring->head % RING_SIZE];
+        if (p[0] != (char)i) {
+            fprintf(stderr, "object %d was overwritten\n", i);
+            exit(1);
+        }
+        if (params->arenas) {
+            mm_arenas_free(params->arenas, p);
+        } else {
+            mm_free(p);
+        }
+        __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/*
+ * pairs_run - runs pairs producer and consumer pairs at once, every consumer
+ * freeing what its producer allocated, objs objects over all pairs
+ */
+static void pairs_run(mm_arenas_t *arenas, int pairs, int objs) {
+    static ring_t rings[PAIRS_MAX];
+    pthread_t threads[2 * PAIRS_MAX];
+    pc_params_t params[PAIRS_MAX];
+
+    memset(rings, 0, sizeof(rings));
+    for (int i = 0; i < pairs; i++) {
+        params[i].arenas = arenas;
+        params[i].ring = &rings[i];
+        params[i].objs = objs / pairs;
+        if (pthread_create(&threads[2 * i], NULL, producer, &params[i]) ||
+            pthread_create(&threads[2 * i + 1], NULL, consumer, &params[i])) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < 2 * pairs; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+// the function timed by fsecs for the arenas benchmark
+static void arenas_run(void *argp) {
+    pairs_run(argp, ARENAS_PAIRS, ARENAS_OBJS);
+}
+
+/*
+ * arenas_bench - passes objects from producer to consumer threads through
+ * 1 to ARENAS_MAX arenas, so that every free is a cross-thread free. Reports
+ * the cost per object with the consumers taking the owning arena's lock and
+ * with them pushing onto its remote stack, and how often a thread found its
+ * arena busy and moved on.
+ */
+void arenas_bench() {
+    printf("arenas: %d producer/consumer pairs passing %d objects\n",
+           ARENAS_PAIRS, ARENAS_OBJS);
+    printf("%8s %14s %14s %10s\n", "arenas", "locked ns/obj", "queued ns/obj",
+           "moves");
+    for (int n = 1; n <= ARENAS_MAX; n *= 2) {
+        double secs[2];
+        long moves = 0;
+        for (int queued = 0; queued < 2; queued++) {
+            mm_arenas_t *arenas = mm_arenas_create(n, ARENAS_MEM);
+            if (arenas == NULL) {
+                fprintf(stderr, "could not create %d arenas\n", n);
+                exit(1);
+            }
+            mm_arenas_set_remote_queues(arenas, queued);
+            secs[queued] = fsecs(arenas_run, arenas);
+            moves += mm_arenas_moves(arenas);
+            mm_arenas_destroy(arenas);
+        }
+        printf("%8d %14.1f %14.1f %10ld\n", n, secs[0] / ARENAS_OBJS * 1e9,
+               secs[1] / ARENAS_OBJS * 1e9, moves);
+    }
+}
+
+/* One thread of a stress benchmark */
+typedef struct {
+    int threads;   /* threads running the benchmark */
+    unsigned seed; /* for rand_r */
+    void **slots;  /* the objects the thread keeps */
+    void *obj;     /* scratch: the object handed to the thread */
+} stress_thread_t;
+
+/* Parameters handed to the stress runs through fsecs */
+typedef struct {
+    int threads;
+    long ops; /* mallocs and frees of the last run, set by the run */
+} stress_params_t;
+
+static stress_thread_t stress_threads[STRESS_MAX];
+static void *stress_slots[STRESS_MAX][STRESS_SLOTS];
+
+// empties the default heap for the next timed run
+static void stress_reset(void) {
+    mem_reset_brk();
+    if (mm_init() < 0) {
+        fprintf(stderr, "mm_init failed\n");
+        exit(1);
+    }
+}
+
+// mallocs from the default heap, exiting if it is full
+static void *stress_malloc(long size) {
+    void *p = mm_malloc(size);
+
+    if (p == NULL) {
+        fprintf(stderr, "mm_malloc failed\n");
+        exit(1);
+    }
+    return p;
+}
+
+/*
+ * stress_spawn - runs fn in n new threads, each handed its own entry of
+ * stress_threads, and waits for all of them
+ */
+static void stress_spawn(int n, void *(*fn)(void *)) {
+    pthread_t threads[STRESS_MAX];
+
+    for (int i = 0; i < n; i++) {
+        stress_threads[i].threads = n;
+        stress_threads[i].slots = stress_slots[i];
+        if (pthread_create(&threads[i], NULL, fn, &stress_threads[i])) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+/*
+ * stress_bench - prints one row per thread count, from first to STRESS_MAX,
+ * with the ops per second of run and the heap size it left behind. The heap
+ * only grows during a run, so that is its peak. If shared is not NULL, it is
+ * called on the heap the last run left and its count is printed too.
+ */
+static void stress_bench(fsecs_test_funct run, int first,
+                         int (*shared)(int threads)) {
+    stress_params_t params;
+
+    printf("%8s %12s %16s%s\n", "threads", "Kops/s", "peak heap bytes",
+           shared ? "  shared lines" : "");
+    for (int n = first; n <= STRESS_MAX; n *= 2) {
+        params.threads = n;
+        double secs = fsecs(run, &params);
+        printf("%8d %12.0f %16ld", n, params.ops / secs / 1e3, mem_heapsize());
+        if (shared) {
+            printf(" %13d", shared(n));
+        }
+        printf("\n");
+    }
+}
+
+// one generation of a larson thread: replaces random objects of its set
+static void *larson_thread(void *argp) {
+    stress_thread_t *t = argp;
+    int ops = LARSON_OPS / LARSON_ROUNDS / t->threads;
+
+    for (int i = 0; i < ops; i++) {
+        int s = rand_r(&t->seed) % LARSON_SLOTS;
+        mm_free(t->slots[s]);
+        t->slots[s] =
+            stress_malloc(16 + rand_r(&t->seed) % (LARSON_MAX_SIZE - 15));
+    }
+    return NULL;
+}
+
+/*
+ * larson_run - the function timed by fsecs: the main thread fills a set of
+ * objects for every thread, and LARSON_ROUNDS generations of threads in turn
+ * take the sets over, like server threads that come and go
+ */
+static void larson_run(void *argp) {
+    stress_params_t *params = argp;
+    int n = params->threads;
+
+    stress_reset();
+    srand(330);
+    for (int i = 0; i < n; i++) {
+        stress_threads[i].seed = 330 + i;
+        for (int s = 0; s < LARSON_SLOTS; s++) {
+            stress_slots[i][s] =
+                stress_malloc(16 + rand() % (LARSON_MAX_SIZE - 15));
+        }
+    }
+    for (int round = 0; round < LARSON_ROUNDS; round++) {
+        stress_spawn(n, larson_thread);
+    }
+    for (int i = 0; i < n; i++) {
+        for (int s = 0; s < LARSON_SLOTS; s++) {
+            mm_free(stress_slots[i][s]);
+        }
+    }
+    params->ops = 2L * n * LARSON_SLOTS +
+                  2L * LARSON_ROUNDS * n * (LARSON_OPS / LARSON_ROUNDS / n);
+}
+
+/*
+ * larson_bench - server churn: every thread replaces random objects of a set
+ * that was allocated by threads before it and is freed by threads after it
+ */
+void larson_bench() {
+    printf(
+        "larson: %d objects of 16-%d bytes per thread, %d replacements over "
+        "%d thread generations\n",
+        LARSON_SLOTS, LARSON_MAX_SIZE, LARSON_OPS, LARSON_ROUNDS);
+    stress_bench(larson_run, 1, NULL);
+}
+
+// a threadtest thread: allocates its share of the objects, then frees them
+static void *threadtest_thread(void *argp) {
+    stress_thread_t *t = argp;
+    int n = THREADTEST_OBJS / t->threads;
+
+    for (int round = 0; round < THREADTEST_ROUNDS; round++) {
+        for (int i = 0; i < n; i++) {
+            t->slots[i] = stress_malloc(THREADTEST_SIZE);
+        }
+        for (int i = 0; i < n; i++) {
+            mm_free(t->slots[i]);
+        }
+    }
+    return NULL;
+}
+
+// the function timed by fsecs for the threadtest benchmark
+static void threadtest_run(void *argp) {
+    stress_params_t *params = argp;
+
+    stress_reset();
+    stress_spawn(params->threads, threadtest_thread);
+    params->ops = 2L * THREADTEST_ROUNDS *
+                  (THREADTEST_OBJS / params->threads * params->threads);
+}
+
+/*
+ * threadtest_bench - every thread allocates and frees objects of one size in
+ * rounds, never touching another thread's
+ */
+void threadtest_bench() {
+    printf("threadtest: %d %d-byte objects over all threads, %d rounds\n",
+           THREADTEST_OBJS, THREADTEST_SIZE, THREADTEST_ROUNDS);
+    stress_bench(threadtest_run, 1, NULL);
+}
+
+// the function timed by fsecs for the xmalloc benchmark
+static void xmalloc_run(void *argp) {
+    stress_params_t *params = argp;
+    int pairs = params->threads / 2;
+
+    stress_reset();
+    pairs_run(NULL, pairs, XMALLOC_OBJS);
+    params->ops = 2L * (XMALLOC_OBJS / pairs * pairs);
+}
+
+/*
+ * xmalloc_bench - half of the threads allocate objects that the other half
+ * free, through the default heap, so that every free is a cross-thread free
+ */
+void xmalloc_bench() {
+    printf("xmalloc: producer/consumer pairs passing %d objects\n",
+           XMALLOC_OBJS);
+    stress_bench(xmalloc_run, 2, NULL);
+}
+
+/*
+ * a scratch thread: frees the object it was handed, then allocates objects
+ * of the same size and writes to all of them in turn, keeping every one live.
+ * If one shares a cache line with another thread's, every write to it
+ * bounces the line between the two CPUs.
+ */
+static void *scratch_thread(void *argp) {
+    stress_thread_t *t = argp;
+
+    mm_free(t->obj);
+    for (int i = 0; i < SCRATCH_OBJS; i++) {
+        t->slots[i] = stress_malloc(SCRATCH_SIZE);
+    }
+    for (int w = 0; w < SCRATCH_WRITES; w++) {
+        for (int i = 0; i < SCRATCH_OBJS; i++) {
+            ((volatile char *)t->slots[i])[w % SCRATCH_SIZE]++;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * scratch_run - the function timed by fsecs: the main thread allocates one
+ * small object per thread, side by side, and hands them out. The threads'
+ * own objects stay live until the next run empties the heap.
+ */
+static void scratch_run(void *argp) {
+    stress_params_t *params = argp;
+    int n = params->threads;
+
+    stress_reset();
+    for (int i = 0; i < n; i++) {
+        stress_threads[i].obj = stress_malloc(SCRATCH_SIZE);
+    }
+    stress_spawn(n, scratch_thread);
+    params->ops = n * (2L + SCRATCH_OBJS);
+}
+
+// orders cache lines, for qsort
+static int compare_lines(const void *a, const void *b) {
+    long la = *(const long *)a, lb = *(const long *)b;
+    return (la > lb) - (la < lb);
+}
+
+/*
+ * scratch_shared - returns the number of cache lines that hold objects of
+ * more than one of the n threads of the last scratch run, all of which were
+ * live at once
+ */
+static int scratch_shared(int n) {
+    static long keys[STRESS_MAX * SCRATCH_OBJS];
+    int shared = 0;
+
+    // a line and the thread using it, sorted by line and then thread
+    for (int i = 0; i < n; i++) {
+        for (int k = 0; k < SCRATCH_OBJS; k++) {
+            long line = (long)stress_threads[i].slots[k] / CACHE_LINE;
+            keys[i * SCRATCH_OBJS + k] = line * STRESS_MAX + i;
+        }
+    }
+    qsort(keys, n * SCRATCH_OBJS, sizeof(long), compare_lines);
+    // a line is shared if its keys do not all name the thread of its first
+    for (int k = 0, first = 0; k < n * SCRATCH_OBJS; k++) {
+        if (keys[k] / STRESS_MAX != keys[first] / STRESS_MAX) {
+            first = k;
+        } else if (keys[k] % STRESS_MAX != keys[first] % STRESS_MAX &&
+                   keys[k - 1] % STRESS_MAX == keys[first] % STRESS_MAX) {
+            shared++;
+        }
+    }
+    return shared;
+}
+
+/*
+ * scratch_bench - detects allocator-induced false sharing, cache-scratch
+ * style: a good allocator does not hand a thread memory on the same cache
+ * line as another thread's
+ */
+void scratch_bench() {
+    printf("scratch: %d %d-byte objects per thread, %d writes to each\n",
+           SCRATCH_OBJS, SCRATCH_SIZE, SCRATCH_WRITES);
+    stress_bench(scratch_run, 1, scratch_shared);
+}
+
+/*
+ * A node of a binary search tree that survives a restart: its links are
+ * offsets from the node itself, 0 for none, so they hold wherever the heap
+ * file is mapped
+ */
+typedef struct {
+    long key;
+    long left;
+    long right;
+} tree_node_t;
+
+/* Parameters handed to the persist runs through fsecs */
+typedef struct {
+    int flags;  /* flags for mm_heap_open, or whether to crash on reopen */
+    int file;   /* build in the heap file rather than in fresh memory */
+    long found; /* depth of the leftmost leaf, as the last run found it */
+} persist_params_t;
+
+static tree_node_t *tree_child(tree_node_t *node, long link) {
+    return link == 0 ? NULL : (tree_node_t *)((char *)node + link);
+}
+
+/*
+ * tree_build - inserts PERSIST_NODES random keys into a new tree on heap and
+ * returns its root, which it also makes the heap's root
+ */
+static tree_node_t *tree_build(mm_heap_t *heap) {
+    tree_node_t *root = NULL;
+
+    srand(330);
+    for (int i = 0; i < PERSIST_NODES; i++) {
+        tree_node_t *node = mm_heap_malloc(heap, sizeof(tree_node_t));
+        if (node == NULL) {
+            fprintf(stderr, "mm_heap_malloc failed\n");
+            exit(1);
+        }
+        node->key = (long)rand() * RAND_MAX + rand();
+        node->left = node->right = 0;
+        if (root == NULL) {
+            root = node;
+            continue;
+        }
+        for (tree_node_t *at = root;;) {
+            long *link = node->key < at->key ? &at->left : &at->right;
+            if (*link == 0) {
+                *link = (char *)node - (char *)at;
+                break;
+            }
+            at = tree_child(at, *link);
+        }
+    }
+    mm_heap_set_root(heap, root);
+    return root;
+}
+
+// returns the depth of the leftmost leaf, a lookup's worth of work
+static long tree_probe(tree_node_t *node) {
+    long depth = 0;
+
+    for (; node != NULL; node = tree_child(node, node->left)) {
+        depth++;
+    }
+    return depth;
+}
+
+/*
+ * persist_build_run - the function timed by fsecs: builds the tree in a new
+ * heap file, or in fresh anonymous memory, and closes the heap again
+ */
+static void persist_build_run(void *argp) {
+    persist_params_t *params = argp;
+    memlib_t *mem;
+    mm_heap_t *heap;
+
+    if (params->file) {
+        unlink(PERSIST_FILE);
+        mem = mem_open_file(PERSIST_FILE, PERSIST_MEM);
+        heap = mem == NULL ? NULL : mm_heap_open(mem, params->flags);
+    } else {
+        mem = mem_create(PERSIST_MEM);
+        heap = mem == NULL ? NULL : mm_heap_create(mem);
+    }
+    if (heap == NULL) {
+        fprintf(stderr, "could not create the tree's heap\n");
+        exit(1);
+    }
+    params->found = tree_probe(tree_build(heap));
+    if (params->file) {
+        mm_heap_close(heap);
+    } else {
+        mm_heap_destroy(heap);
+    }
+    mem_destroy(mem);
+}
+
+/*
+ * persist_reopen_run - the function timed by fsecs: reopens the heap file
+ * and looks up the tree. Unless flags ask for a crash, the heap is closed
+ * properly; otherwise it is dropped with a stale header, the way a process
+ * that dies leaves it, and the next run has to rebuild it.
+ */
+static void persist_reopen_run(void *argp) {
+    persist_params_t *params = argp;
+    memlib_t *mem = mem_open_file(PERSIST_FILE, PERSIST_MEM);
+    mm_heap_t *heap = mem == NULL ? NULL : mm_heap_open(mem, 0);
+
+    if (heap == NULL) {
+        fprintf(stderr, "could not reopen the heap file\n");
+        exit(1);
+    }
+    params->found = tree_probe(mm_heap_root(heap));
+    if (params->flags) {
+        mm_heap_destroy(heap);
+    } else {
+        mm_heap_close(heap);
+    }
+    mem_destroy(mem);
+}
+
+/*
+ * persist_bench - builds a search tree in a heap file, and compares the time
+ * it takes to get it back by reopening the file, after a clean close and
+ * after a crash, against building it again from scratch. Needs a build with
+ * persistent heaps (mmbench-offsets).
+ */
+void persist_bench() {
+    persist_params_t plain = {0, 1, 0}, safe = {MM_PERSIST_CRASH_SAFE, 1, 0};
+    persist_params_t fresh = {0, 0, 0}, clean = {0, 1, 0}, crash = {1, 1, 0};
+    memlib_t *mem = mem_create(PERSIST_MEM);
+    mm_heap_t *probe = mm_heap_open(mem, 0);
+
+    printf("persist: a %d-node search tree in a %d MB heap file\n",
+           PERSIST_NODES, PERSIST_MEM >> 20);
+    if (probe == NULL) {
+        printf("needs a build with -D MM_OFFSETS=1, e.g. mmbench-offsets\n");
+        mem_destroy(mem);
+        return;
+    }
+    mm_heap_destroy(probe);
+    mem_destroy(mem);
+    printf("%-28s %12s\n", "", "ms");
+    printf("%-28s %12.3f\n", "build in fresh memory",
+           fsecs(persist_build_run, &fresh) * 1e3);
+    printf("%-28s %12.3f\n", "build in the file",
+           fsecs(persist_build_run, &plain) * 1e3);
+    printf("%-28s %12.3f\n", "... crash-safe",
+           fsecs(persist_build_run, &safe) * 1e3);
+    printf("%-28s %12.3f\n", "reopen after a close",
+           fsecs(persist_reopen_run, &clean) * 1e3);
+    persist_reopen_run(&crash); /* leaves the header stale for the runs */
+    printf("%-28s %12.3f\n", "reopen after a crash",
+           fsecs(persist_reopen_run, &crash) * 1e3);
+    if (clean.found != fresh.found || crash.found != fresh.found) {
+        fprintf(stderr, "the reopened tree differs\n");
+        exit(1);
+    }
+    unlink(PERSIST_FILE);
+}
+
+/*
+ * The queue between the processes of the shared benchmark, the root of the
+ * shared heap: a ring of message offsets (see mm_heap_offset), as the two
+ * processes map the heap at different addresses
+ */
+typedef struct {
+    long slots[RING_SIZE];
+    unsigned head; /* next slot to take, written by the consumer */
+    unsigned tail; /* next slot to fill, written by the producer */
+    long sum;      /* what the consumer read, for checking */
+} shared_ring_t;
+
+/* Parameters handed to the shared runs through fsecs */
+typedef struct {
+    long size;  /* bytes per message */
+    int shared; /* pass messages in the shared heap rather than a pipe */
+    long sum;   /* what the consumer read in the last run */
+} shared_params_t;
+
+// fills message i with a pattern that shared_sum adds up
+static void shared_fill(long *msg, long size, long i) {
+    for (long w = 0; w < size / WORD_SIZE; w++) {
+        msg[w] = i + w;
+    }
+}
+
+// reads a whole message, the way a consumer would use it
+static long shared_sum(const long *msg, long size) {
+    long sum = 0;
+
+    for (long w = 0; w < size / WORD_SIZE; w++) {
+        sum += msg[w];
+    }
+    return sum;
+}
+
+/*
+ * shared_consume - the consumer process of a shared run: opens the shared
+ * heap by name, which maps it at an address of its own, and reads and frees
+ * every message the producer queues
+ */
+static void shared_consume(long size, long msgs) {
+    memlib_t *mem = mem_open_shared(SHARED_NAME, SHARED_MEM);
+    mm_heap_t *heap = mem == NULL ? NULL : mm_heap_open(mem, MM_PERSIST_SHARED);
+    shared_ring_t *ring;
+    long sum = 0;
+
+    if (heap == NULL) {
+        fprintf(stderr, "consumer: could not open the shared heap\n");
+        _exit(1);
+    }
+    ring = mm_heap_root(heap);
+    for (long i = 0; i < msgs; i++) {
+        while (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ring->head) {
+            sched_yield();
+        }
+        long *msg = mm_heap_pointer(heap, ring->slots[ring->head % RING_SIZE]);
+        sum += shared_sum(msg, size);
+        mm_heap_free(heap, msg);
+        __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+    }
+    ring->sum = sum;
+    mm_heap_close(heap);
+    mem_destroy(mem);
+    _exit(0);
+}
+
+/*
+ * shared_heap_run - passes SHARED_BYTES of messages to a child process
+ * through a heap in shared memory: the producer writes each message in
+ * place and queues its offset, and the consumer reads it where it is
+ */
+static void shared_heap_run(shared_params_t *params) {
+    long msgs = SHARED_BYTES / params->size;
+    memlib_t *mem;
+    mm_heap_t *heap;
+    shared_ring_t *ring;
+    pid_t child;
+    int status;
+
+    mem_unlink_shared(SHARED_NAME);
+    mem = mem_open_shared(SHARED_NAME, SHARED_MEM);
+    heap = mem == NULL ? NULL : mm_heap_open(mem, MM_PERSIST_SHARED);
+    if (heap == NULL ||
+        (ring = mm_heap_malloc(heap, sizeof(shared_ring_t))) == NULL) {
+        fprintf(stderr, "could not create the shared heap\n");
+        exit(1);
+    }
+    memset(ring, 0, sizeof(shared_ring_t));
+    mm_heap_set_root(heap, ring);
+    if ((child = fork()) == 0) {
+        shared_consume(params->size, msgs);
+    }
+    for (long i = 0; i < msgs; i++) {
+        long *msg = mm_heap_malloc(heap, params->size);
+        if (msg == NULL) {
+            fprintf(stderr, "producer: mm_heap_malloc failed\n");
+            exit(1);
+        }
+        shared_fill(msg, params->size, i);
+        while (ring->tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+               RING_SIZE) {
+            sched_yield();
+        }
+        ring->slots[ring->tail % RING_SIZE] = mm_heap_offset(heap, msg);
+        __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+    }
+    if (waitpid(child, &status, 0) < 0 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "the consumer process failed\n");
+        exit(1);
+    }
+    params->sum = ring->sum;
+    mm_heap_close(heap);
+    mem_destroy(mem);
+    mem_unlink_shared(SHARED_NAME);
+}
+
+/*
+ * shared_pipe_run - passes the same messages through a pipe instead, which
+ * copies each one into the kernel and out again
+ */
+static void shared_pipe_run(shared_params_t *params) {
+    long msgs = SHARED_BYTES / params->size;
+    long *msg = malloc(params->size);
+    int data[2], result[2];
+    pid_t child;
+
+    if (msg == NULL || pipe(data) < 0 || pipe(result) < 0) {
+        fprintf(stderr, "could not set up the pipe run\n");
+        exit(1);
+    }
+    if ((child = fork()) == 0) {
+        long sum = 0;
+        close(data[1]);
+        for (long i = 0; i < msgs; i++) {
+            for (long got = 0; got < params->size;) {
+                long n = read(data[0], (char *)msg + got, params->size - got);
+                if (n <= 0) {
+                    _exit(1);
+                }
+                got += n;
+            }
+            sum += shared_sum(msg, params->size);
+        }
+        _exit(write(result[1], &sum, sizeof(sum)) == sizeof(sum) ? 0 : 1);
+    }
+    close(data[0]);
+    for (long i = 0; i < msgs; i++) {
+        shared_fill(msg, params->size, i);
+        if (write(data[1], msg, params->size) != params->size) {
+            fprintf(stderr, "write to the pipe failed\n");
+            exit(1);
+        }
+    }
+    if (read(result[0], &params->sum, sizeof(long)) != sizeof(long)) {
+        fprintf(stderr, "the consumer process failed\n");
+        exit(1);
+    }
+    waitpid(child, NULL, 0);
+    close(data[1]);
+    close(result[0]);
+    close(result[1]);
+    free(msg);
+}
+
+// the function timed by fsecs for the shared benchmark
+static void shared_run(void *argp) {
+    shared_params_t *params = argp;
+
+    if (params->shared) {
+        shared_heap_run(params);
+    } else {
+        shared_pipe_run(params);
+    }
+}
+
+/*
+ * shared_bench - passes messages from a producer process to a consumer
+ * process, which reads and frees them, through a heap both map from shared
+ * memory and, as a baseline, by copying them through a pipe. Needs a build
+ * with persistent heaps (mmbench-offsets).
+ */
+void shared_bench() {
+    memlib_t *mem = mem_create(SHARED_MEM);
+    mm_heap_t *probe = mm_heap_open(mem, MM_PERSIST_SHARED);
+
+    printf("shared: %d MB of messages from one process to another\n",
+           SHARED_BYTES >> 20);
+    if (probe == NULL) {
+        printf("needs a build with -D MM_OFFSETS=1, e.g. mmbench-offsets\n");
+        mem_destroy(mem);
+        return;
+    }
+    mm_heap_destroy(probe);
+    mem_destroy(mem);
+    printf("%8s %14s %14s %14s %14s\n", "size", "heap msgs/s", "heap MB/s",
+           "pipe msgs/s", "pipe MB/s");
+    for (long size = SHARED_MIN; size <= SHARED_MAX; size *= 16) {
+        shared_params_t heap = {size, 1, 0}, pipe = {size, 0, 0};
+        double heap_secs = fsecs(shared_run, &heap);
+        double pipe_secs = fsecs(shared_run, &pipe);
+        long msgs = SHARED_BYTES / size;
+        if (heap.sum != pipe.sum) {
+            fprintf(stderr, "the consumers read different messages\n");
+            exit(1);
+        }
+        printf("%8ld %14.0f %14.1f %14.0f %14.1f\n", size, msgs / heap_secs,
+               SHARED_BYTES / heap_secs / (1 << 20), msgs / pipe_secs,
+               SHARED_BYTES / pipe_secs / (1 << 20));
+    }
+}
+
+/*
+ * each benchmark has a name on the command line
+ * and a function that runs it
+ */
+struct {
+    const char *name;
+    void (*run)(void);
+} bench_table[] = {{"batch", batch_bench},     {"heaps", heaps_bench},
+                   {"index", index_bench},     {"arenas", arenas_bench},
+                   {"larson", larson_bench},   {"threadtest", threadtest_bench},
+                   {"xmalloc", xmalloc_bench}, {"scratch", scratch_bench},
+                   {"persist", persist_bench}, {"shared", shared_bench}};
+
+int main(int argc, char **argv) {
+    unsigned num_benches = sizeof(bench_table) / sizeof(bench_table[0]);
+
+    if (argc < 2) {
+        printf("%s\n", USAGE);
+        return 1;
+    }
+    mem_init();
+    init_fsecs();
+    for (int i = 1; i < argc; i++) {
+        int found = 0;
+        for (unsigned j = 0; j < num_benches; j++) {
+            if (!strcmp(argv[i], "all") ||
+                !strcmp(argv[i], bench_table[j].name)) {
+                bench_table[j].run();
+                printf("\n");
+                found = 1;
+            }
+        }
+        if (!found) {
+            printf("unknown benchmark '%s'\n%s\n", argv[i], USAGE);
+            return 1;
+        }
+    }
+    mem_deinit();
+    return 0;
+}
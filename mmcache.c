@@ -0,0 +1,138 @@
+/*
+ * mmcache.c - the cache simulator behind -D MM_CACHE_SIM=1. See mmcache.h.
+ *             Each level keeps, per way, the line it holds and when that
+ *             line was last used, in one clock shared by all levels; a miss
+ *             evicts the way used longest ago.
+ */
+#include "mmcache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* one level of the hierarchy */
+typedef struct {
+    long sets;
+    int ways;
+    unsigned long *lines;  // sets * ways line numbers plus one; 0 is empty
+    unsigned long *used;   // when each way was last used
+} cache_level_t;
+
+// the hierarchy used until mm_cache_configure picks another: 32K 8-way L1,
+// 256K 8-way L2 and 8M 16-way LLC
+static const long default_size[] = {32L << 10, 256L << 10, 8L << 20};
+static const int default_ways[] = {8, 8, 16};
+
+static cache_level_t hierarchy[MM_CACHE_LEVELS];
+static int num_levels;
+static unsigned long now;  // the LRU clock
+static mm_cache_stats_t counts;
+
+/*
+ * mm_cache_configure - set up a hierarchy of the given number of levels,
+ *     from L1 outwards, each of size[i] bytes in ways[i] ways, and reset the
+ *     counts. With levels 0, sets up the default hierarchy. Returns 0, or -1
+ *     if a level's size is not a multiple of MM_CACHE_LINE * ways or there is
+ *     no memory for it, in which case the hierarchy is left as it was.
+ */
+int mm_cache_configure(int levels, const long *size, const int *ways) {
+    cache_level_t fresh[MM_CACHE_LEVELS];
+
+    if (levels == 0) {
+        return mm_cache_configure(MM_CACHE_LEVELS, default_size, default_ways);
+    }
+    if (levels < 0 || levels > MM_CACHE_LEVELS) {
+        return -1;
+    }
+    for (int l = 0; l < levels; l++) {
+        long way_bytes = (long)MM_CACHE_LINE * ways[l];
+        fresh[l].ways = ways[l];
+        fresh[l].sets = ways[l] > 0 ? size[l] / way_bytes : 0;
+        fresh[l].lines = NULL;
+        fresh[l].used = NULL;
+        if (fresh[l].sets <= 0 || fresh[l].sets * way_bytes != size[l] ||
+            (fresh[l].lines = calloc(fresh[l].sets * ways[l],
+                                     sizeof(unsigned long))) == NULL ||
+            (fresh[l].used = calloc(fresh[l].sets * ways[l],
+                                    sizeof(unsigned long))) == NULL) {
+            for (int k = 0; k <= l; k++) {
+                free(fresh[k].lines);
+                free(fresh[k].used);
+            }
+            return -1;
+        }
+    }
+    for (int l = 0; l < num_levels; l++) {
+        free(hierarchy[l].lines);
+        free(hierarchy[l].used);
+    }
+    memcpy(hierarchy, fresh, levels * sizeof(cache_level_t));
+    num_levels = levels;
+    memset(&counts, 0, sizeof(counts));
+    counts.levels = num_levels;
+    return 0;
+}
+
+/*
+ * lookup - look for a line in one level, making it the most recently used
+ *     one of its set, and fill it in over the least recently used way if it
+ *     is not there. Returns whether it was there.
+ */
+static int lookup(cache_level_t *level, unsigned long line) {
+    long set = (long)(line % level->sets) * level->ways;
+    unsigned long *lines = level->lines + set;
+    unsigned long *used = level->used + set;
+    int victim = 0;
+
+    for (int w = 0; w < level->ways; w++) {
+        if (lines[w] == line + 1) {
+            used[w] = ++now;
+            return 1;
+        }
+        if (used[w] < used[victim]) {
+            victim = w;
+        }
+    }
+    lines[victim] = line + 1;
+    used[victim] = ++now;
+    return 0;
+}
+
+/*
+ * mm_cache_access - feed an access to size bytes at addr, of the given kind,
+ *     to the simulator, one line at a time. The first access sets up the
+ *     default hierarchy if none was configured.
+ */
+void mm_cache_access(const void *addr, long size, int kind) {
+    unsigned long first = (unsigned long)addr / MM_CACHE_LINE;
+    unsigned long last = ((unsigned long)addr + size - 1) / MM_CACHE_LINE;
+
+    if (num_levels == 0 && mm_cache_configure(0, NULL, NULL) < 0) {
+        return;
+    }
+    for (unsigned long line = first; size > 0 && line <= last; line++) {
+        counts.accesses[kind]++;
+        for (int l = 0; l < num_levels && !lookup(&hierarchy[l], line); l++) {
+            counts.misses[l][kind]++;
+        }
+    }
+}
+
+/*
+ * mm_cache_stats - copy the counts since the last reset into stats
+ */
+void mm_cache_stats(mm_cache_stats_t *stats) { *stats = counts; }
+
+/*
+ * mm_cache_reset - empty every level and zero the counts, keeping the
+ *     hierarchy
+ */
+void mm_cache_reset(void) {
+    for (int l = 0; l < num_levels; l++) {
+        long n = hierarchy[l].sets * hierarchy[l].ways;
+        memset(hierarchy[l].lines, 0, n * sizeof(unsigned long));
+        memset(hierarchy[l].used, 0, n * sizeof(unsigned long));
+    }
+    now = 0;
+    memset(&counts, 0, sizeof(counts));
+    counts.levels = num_levels;
+}
@@ -0,0 +1,54 @@
+#ifndef MMCACHE_H_
+#define MMCACHE_H_
+
+/*
+ * A simulated cache hierarchy, for a view of how cache-friendly an allocator
+ * is that does not depend on the machine it runs on or on what else runs
+ * there. Every level is set-associative with LRU replacement and lines of
+ * MM_CACHE_LINE bytes. An access that misses a level goes on to the next one,
+ * and its line is then filled into every level that missed. Reads and writes
+ * are not told apart. The simulator models a single core and keeps no locks,
+ * so it must only be fed by one thread at a time.
+ *
+ * With -D MM_CACHE_SIM=1, the tag and link helpers in mminline.h, and mm.c's
+ * flag helpers, feed every access they make to the simulator through
+ * mm_cache_touch, by kind. The Makefile builds that variant with NDEBUG, as
+ * the reads asserts make would count too and a real build has none. Without
+ * it (the default), mm_cache_touch is nothing and the simulator only sees
+ * what is passed to mm_cache_access directly, such as the payload writes of
+ * mdriver's -K replay.
+ */
+#ifndef MM_CACHE_SIM
+#define MM_CACHE_SIM 0
+#endif
+
+#define MM_CACHE_LINE 64   // bytes per line, at every level
+#define MM_CACHE_LEVELS 3  // most levels in a hierarchy
+
+/* what an access was for */
+#define MM_CACHE_HEADER 0   // a block's beginning tag
+#define MM_CACHE_FOOTER 1   // a block's end tag
+#define MM_CACHE_LINK 2     // a free-list link
+#define MM_CACHE_PAYLOAD 3  // the payload, as the caller writes it
+#define MM_CACHE_KINDS 4
+
+/* what the simulator saw since it was last reset */
+typedef struct {
+    int levels;                     // levels in the hierarchy
+    long accesses[MM_CACHE_KINDS];  // line accesses, by kind
+    long misses[MM_CACHE_LEVELS][MM_CACHE_KINDS];  // ... and missed per level
+} mm_cache_stats_t;
+
+/* the simulator, in mmcache.c */
+int mm_cache_configure(int levels, const long *size, const int *ways);
+void mm_cache_access(const void *addr, long size, int kind);
+void mm_cache_stats(mm_cache_stats_t *stats);
+void mm_cache_reset(void);
+
+#if MM_CACHE_SIM
+#define mm_cache_touch(addr, size, kind) mm_cache_access((addr), (size), (kind))
+#else
+#define mm_cache_touch(addr, size, kind) ((void)0)
+#endif
+
+#endif  // MMCACHE_H_
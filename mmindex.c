@@ -0,0 +1,537 @@
+/*
+ * mmindex.c - packed size arrays that speed up free-list searches. See
+ *             mmindex.h for what an index holds. The scans come in AVX2,
+ *             SSE4.1 and scalar versions; the best one the CPU supports is
+ *             picked the first time an index is searched. The hash table
+ *             of offsets uses linear probing, and closes the gap a deleted
+ *             slot leaves by shifting later slots back.
+ */
+#include "mmindex.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#else
+#define HAVE_X86_SIMD 0
+#endif
+
+/* one set of scan kernels; every kernel returns an index into v, or -1 */
+typedef struct {
+    const char *name;
+    // the first i with v[i] >= need
+    int (*first_ge)(const uint32_t *v, int n, uint32_t need);
+    // an i with the smallest v[i] >= need
+    int (*best_ge)(const uint32_t *v, int n, uint32_t need);
+    // how many i have v[i] == x
+    int (*count_eq)(const uint32_t *v, int n, uint32_t x);
+} kernels_t;
+
+#define MIN_CAPACITY 64  // entries allocated for the first block of a list
+
+/*
+ * scalar kernels, also used for the elements left over after the last full
+ * vector in the SIMD kernels
+ */
+static int first_ge_scalar(const uint32_t *v, int n, uint32_t need) {
+    for (int i = 0; i < n; i++) {
+        if (v[i] >= need) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int best_ge_scalar(const uint32_t *v, int n, uint32_t need) {
+    int best = -1;
+    for (int i = 0; i < n; i++) {
+        if (v[i] >= need && (best < 0 || v[i] < v[best])) {
+            best = i;
+            if (v[i] == need) {
+                break;
+            }
+        }
+    }
+    return best;
+}
+
+static int count_eq_scalar(const uint32_t *v, int n, uint32_t x) {
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        count += v[i] == x;
+    }
+    return count;
+}
+
+#if HAVE_X86_SIMD
+// the first i with v[i] == x, which the best fit kernels look the minimum up
+// with
+static int find_eq_scalar(const uint32_t *v, int n, uint32_t x) {
+    for (int i = 0; i < n; i++) {
+        if (v[i] == x) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * SSE4.1 kernels, 4 sizes per compare. There is no unsigned compare, so
+ * v >= need is computed as max(v, need) == v.
+ */
+__attribute__((target("sse4.1"))) static int first_ge_sse4(const uint32_t *v,
+                                                           int n,
+                                                           uint32_t need) {
+    __m128i needv = _mm_set1_epi32((int)need);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(v + i));
+        __m128i ge = _mm_cmpeq_epi32(_mm_max_epu32(x, needv), x);
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(ge));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    int rest = first_ge_scalar(v + i, n - i, need);
+    return rest < 0 ? -1 : i + rest;
+}
+
+__attribute__((target("sse4.1"))) static int find_eq_sse4(const uint32_t *v,
+                                                          int n, uint32_t x) {
+    __m128i xv = _mm_set1_epi32((int)x);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i y = _mm_loadu_si128((const __m128i *)(v + i));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(y, xv)));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    int rest = find_eq_scalar(v + i, n - i, x);
+    return rest < 0 ? -1 : i + rest;
+}
+
+__attribute__((target("sse4.1"))) static int count_eq_sse4(const uint32_t *v,
+                                                           int n, uint32_t x) {
+    __m128i xv = _mm_set1_epi32((int)x);
+    int count = 0;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i y = _mm_loadu_si128((const __m128i *)(v + i));
+        count += __builtin_popcount(
+            _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(y, xv))));
+    }
+    return count + count_eq_scalar(v + i, n - i, x);
+}
+
+// sizes below need are replaced by UINT32_MAX before taking the minimum
+__attribute__((target("sse4.1"))) static int best_ge_sse4(const uint32_t *v,
+                                                          int n,
+                                                          uint32_t need) {
+    __m128i needv = _mm_set1_epi32((int)need);
+    __m128i none = _mm_set1_epi32(-1);
+    __m128i minv = none;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(v + i));
+        int exact =
+            _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(x, needv)));
+        if (exact) {
+            return i + __builtin_ctz(exact);
+        }
+        __m128i ge = _mm_cmpeq_epi32(_mm_max_epu32(x, needv), x);
+        minv = _mm_min_epu32(minv, _mm_blendv_epi8(none, x, ge));
+    }
+    uint32_t lanes[4];
+    uint32_t best = UINT32_MAX;
+    _mm_storeu_si128((__m128i *)lanes, minv);
+    for (int j = 0; j < 4; j++) {
+        best = lanes[j] < best ? lanes[j] : best;
+    }
+    int rest = best_ge_scalar(v + i, n - i, need);
+    if (rest >= 0 && v[i + rest] < best) {
+        return i + rest;
+    }
+    return best == UINT32_MAX ? -1 : find_eq_sse4(v, i, best);
+}
+
+/* AVX2 kernels, the same scans 8 sizes per compare */
+__attribute__((target("avx2"))) static int first_ge_avx2(const uint32_t *v,
+                                                         int n, uint32_t need) {
+    __m256i needv = _mm256_set1_epi32((int)need);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(v + i));
+        __m256i ge = _mm256_cmpeq_epi32(_mm256_max_epu32(x, needv), x);
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(ge));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    int rest = first_ge_scalar(v + i, n - i, need);
+    return rest < 0 ? -1 : i + rest;
+}
+
+__attribute__((target("avx2"))) static int find_eq_avx2(const uint32_t *v,
+                                                        int n, uint32_t x) {
+    __m256i xv = _mm256_set1_epi32((int)x);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i y = _mm256_loadu_si256((const __m256i *)(v + i));
+        int mask =
+            _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(y, xv)));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    int rest = find_eq_scalar(v + i, n - i, x);
+    return rest < 0 ? -1 : i + rest;
+}
+
+__attribute__((target("avx2"))) static int count_eq_avx2(const uint32_t *v,
+                                                         int n, uint32_t x) {
+    __m256i xv = _mm256_set1_epi32((int)x);
+    int count = 0;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i y = _mm256_loadu_si256((const __m256i *)(v + i));
+        count += __builtin_popcount(
+            _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(y, xv))));
+    }
+    return count + count_eq_scalar(v + i, n - i, x);
+}
+
+__attribute__((target("avx2"))) static int best_ge_avx2(const uint32_t *v,
+                                                        int n, uint32_t need) {
+    __m256i needv = _mm256_set1_epi32((int)need);
+    __m256i none = _mm256_set1_epi32(-1);
+    __m256i minv = none;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(v + i));
+        int exact = _mm256_movemask_ps(
+            _mm256_castsi256_ps(_mm256_cmpeq_epi32(x, needv)));
+        if (exact) {
+            return i + __builtin_ctz(exact);
+        }
+        __m256i ge = _mm256_cmpeq_epi32(_mm256_max_epu32(x, needv), x);
+        minv = _mm256_min_epu32(minv, _mm256_blendv_epi8(none, x, ge));
+    }
+    uint32_t lanes[8];
+    uint32_t best = UINT32_MAX;
+    _mm256_storeu_si256((__m256i *)lanes, minv);
+    for (int j = 0; j < 8; j++) {
+        best = lanes[j] < best ? lanes[j] : best;
+    }
+    int rest = best_ge_scalar(v + i, n - i, need);
+    if (rest >= 0 && v[i + rest] < best) {
+        return i + rest;
+    }
+    return best == UINT32_MAX ? -1 : find_eq_avx2(v, i, best);
+}
+#endif
+
+/* every kernel set this build has, best first */
+static const kernels_t kernel_table[] = {
+#if HAVE_X86_SIMD
+    {"avx2", first_ge_avx2, best_ge_avx2, count_eq_avx2},
+    {"sse4.1", first_ge_sse4, best_ge_sse4, count_eq_sse4},
+#endif
+    {"scalar", first_ge_scalar, best_ge_scalar, count_eq_scalar}};
+#define NUM_KERNELS (int)(sizeof(kernel_table) / sizeof(kernel_table[0]))
+
+static const kernels_t *kernels;  // the set in use, NULL until first needed
+
+// returns whether the CPU can run the given kernel set
+static int isa_supported(const kernels_t *k) {
+#if HAVE_X86_SIMD
+    if (!strcmp(k->name, "avx2")) {
+        return __builtin_cpu_supports("avx2");
+    }
+    if (!strcmp(k->name, "sse4.1")) {
+        return __builtin_cpu_supports("sse4.1");
+    }
+#endif
+    return !strcmp(k->name, "scalar");
+}
+
+// returns the kernel set in use, picking the best supported one the first time
+static const kernels_t *get_kernels(void) {
+    if (kernels == NULL) {
+        for (int i = 0; i < NUM_KERNELS && kernels == NULL; i++) {
+            if (isa_supported(&kernel_table[i])) {
+                kernels = &kernel_table[i];
+            }
+        }
+    }
+    return kernels;
+}
+
+/*
+ * size_index_isa - return the name of the scan kernels in use
+ */
+const char *size_index_isa(void) { return get_kernels()->name; }
+
+/*
+ * size_index_set_isa - use the named scan kernels from now on. Returns -1,
+ *     leaving the choice unchanged, if the build or the CPU lacks them.
+ */
+int size_index_set_isa(const char *isa) {
+    for (int i = 0; i < NUM_KERNELS; i++) {
+        if (!strcmp(kernel_table[i].name, isa) &&
+            isa_supported(&kernel_table[i])) {
+            kernels = &kernel_table[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// returns the slot of the hash table an offset is looked for from first
+static inline int slot_home(const size_index_t *idx, uint32_t offset) {
+    return (int)((offset * 2654435761u) & (uint32_t)(idx->num_slots - 1));
+}
+
+// returns the slot that holds the entry of a block at offset, or -1
+static int slot_find(const size_index_t *idx, uint32_t offset) {
+    int mask = idx->num_slots - 1;
+
+    if (idx->num_slots == 0) {
+        return -1;
+    }
+    for (int s = slot_home(idx, offset);; s = (s + 1) & mask) {
+        int e = idx->slots[s] - 1;
+        if (e < 0 || idx->offsets[e] == offset) {
+            return e < 0 ? -1 : s;
+        }
+    }
+}
+
+// adds entry e to the hash table
+static void slot_add(size_index_t *idx, int e) {
+    int mask = idx->num_slots - 1;
+    int s = slot_home(idx, idx->offsets[e]);
+
+    while (idx->slots[s] != 0) {
+        s = (s + 1) & mask;
+    }
+    idx->slots[s] = e + 1;
+}
+
+// empties slot s, moving back every later slot of its run that may take
+// its place, so that no lookup stops short of its entry
+static void slot_delete(size_index_t *idx, int s) {
+    int mask = idx->num_slots - 1;
+    int hole = s;
+
+    for (int t = (s + 1) & mask; idx->slots[t] != 0; t = (t + 1) & mask) {
+        int home = slot_home(idx, idx->offsets[idx->slots[t] - 1]);
+        // the entry stays if its home lies after the hole, up to t
+        if (((t - home) & mask) >= ((t - hole) & mask)) {
+            idx->slots[hole] = idx->slots[t];
+            hole = t;
+        }
+    }
+    idx->slots[hole] = 0;
+}
+
+// moves the live entries, in order, to the end of new arrays of capacity
+// entries and rebuilds the hash table for them. Returns 0, or -1 if there is
+// no memory for them, which leaves idx as it was.
+static int repack(size_index_t *idx, int capacity) {
+    uint32_t *sizes = malloc(capacity * sizeof(uint32_t));
+    uint32_t *offsets = malloc(capacity * sizeof(uint32_t));
+    int *slots = calloc(2 * capacity, sizeof(int));
+    int at = capacity;
+
+    if (sizes == NULL || offsets == NULL || slots == NULL) {
+        free(sizes);
+        free(offsets);
+        free(slots);
+        return -1;
+    }
+    for (int e = idx->capacity - 1; e >= idx->first; e--) {
+        if (idx->sizes[e] != 0) {
+            at--;
+            sizes[at] = idx->sizes[e];
+            offsets[at] = idx->offsets[e];
+        }
+    }
+    free(idx->sizes);
+    free(idx->offsets);
+    free(idx->slots);
+    idx->sizes = sizes;
+    idx->offsets = offsets;
+    idx->slots = slots;
+    idx->first = at;
+    idx->capacity = capacity;
+    idx->num_slots = 2 * capacity;
+    for (int e = at; e < capacity; e++) {
+        slot_add(idx, e);
+    }
+    return 0;
+}
+
+// returns the block of entry e
+static inline block_t *entry_block(size_index_t *idx, char *base, int e) {
+    return (block_t *)(base + (long)idx->offsets[e] * ALIGNMENT);
+}
+
+/*
+ * size_index_init - make idx an empty index
+ */
+void size_index_init(size_index_t *idx) { memset(idx, 0, sizeof(*idx)); }
+
+/*
+ * size_index_destroy - free the arrays of idx, leaving it empty
+ */
+void size_index_destroy(size_index_t *idx) {
+    free(idx->sizes);
+    free(idx->offsets);
+    free(idx->slots);
+    size_index_init(idx);
+}
+
+/*
+ * size_index_clear - remove every entry, keeping the arrays for reuse
+ */
+void size_index_clear(size_index_t *idx) {
+    idx->first = idx->capacity;
+    idx->live = 0;
+    if (idx->slots != NULL) {
+        memset(idx->slots, 0, idx->num_slots * sizeof(int));
+    }
+}
+
+/*
+ * size_index_copy - make dst hold the entries of src, in the same order.
+ *     Returns 0, or -1 if its arrays could not grow, which leaves dst empty.
+ */
+int size_index_copy(size_index_t *dst, const size_index_t *src) {
+    if (src->capacity == 0) {
+        size_index_clear(dst);
+        return 0;
+    }
+    if (dst->capacity != src->capacity) {
+        uint32_t *sizes = malloc(src->capacity * sizeof(uint32_t));
+        uint32_t *offsets = malloc(src->capacity * sizeof(uint32_t));
+        int *slots = malloc(src->num_slots * sizeof(int));
+        if (sizes == NULL || offsets == NULL || slots == NULL) {
+            free(sizes);
+            free(offsets);
+            free(slots);
+            size_index_clear(dst);
+            return -1;
+        }
+        size_index_destroy(dst);
+        dst->sizes = sizes;
+        dst->offsets = offsets;
+        dst->slots = slots;
+        dst->capacity = src->capacity;
+        dst->num_slots = src->num_slots;
+    }
+    memcpy(dst->sizes, src->sizes, src->capacity * sizeof(uint32_t));
+    memcpy(dst->offsets, src->offsets, src->capacity * sizeof(uint32_t));
+    memcpy(dst->slots, src->slots, src->num_slots * sizeof(int));
+    dst->first = src->first;
+    dst->live = src->live;
+    return 0;
+}
+
+/*
+ * size_index_insert - add the free block b, which lies at or after base, in
+ *     front of every other entry, as the list does. The arrays are repacked
+ *     once there is no room left in front; they double if more than half of
+ *     them is live.
+ */
+void size_index_insert(size_index_t *idx, char *base, block_t *b) {
+    if (idx->first == 0) {
+        int capacity = idx->capacity;
+        if (capacity < MIN_CAPACITY) {
+            capacity = MIN_CAPACITY;
+        } else if (idx->live > capacity / 2) {
+            capacity *= 2;
+        }
+        if (repack(idx, capacity) < 0) {
+            return;  // leave b out, see mmindex.h
+        }
+    }
+    int e = --idx->first;
+    idx->sizes[e] = (uint32_t)(b->size / ALIGNMENT);
+    idx->offsets[e] = (uint32_t)(((char *)b - base) / ALIGNMENT);
+    idx->live++;
+    slot_add(idx, e);
+}
+
+/*
+ * size_index_remove - remove the block b, if it is in the index. Its entry
+ *     is marked removed; the arrays are repacked once removed entries
+ *     outnumber live ones, so that a scan stays proportional to the list.
+ */
+void size_index_remove(size_index_t *idx, char *base, block_t *b) {
+    uint32_t offset = (uint32_t)(((char *)b - base) / ALIGNMENT);
+    int s = slot_find(idx, offset);
+
+    if (s < 0) {
+        return;
+    }
+    idx->sizes[idx->slots[s] - 1] = 0;
+    idx->live--;
+    slot_delete(idx, s);
+    while (idx->first < idx->capacity && idx->sizes[idx->first] == 0) {
+        idx->first++;
+    }
+    if (idx->capacity - idx->first > 2 * idx->live + MIN_CAPACITY) {
+        repack(idx, idx->capacity);  // on failure, just scan the gaps
+    }
+}
+
+/*
+ * size_index_first_fit - return the first indexed block of at least size
+ *     bytes in list order, or NULL if there is none. Adds the number of
+ *     blocks a walk of the list would have looked at to searched.
+ */
+block_t *size_index_first_fit(size_index_t *idx, char *base, long size,
+                              long *searched) {
+    uint32_t need = (uint32_t)(size / ALIGNMENT);
+    uint32_t *sizes = idx->sizes + idx->first;
+    const kernels_t *k = get_kernels();
+    int i;
+
+    if (idx->live == 0 ||
+        (i = k->first_ge(sizes, idx->capacity - idx->first, need)) < 0) {
+        *searched += idx->live;
+        return NULL;
+    }
+    *searched += i + 1 - k->count_eq(sizes, i, 0);
+    return entry_block(idx, base, idx->first + i);
+}
+
+/*
+ * size_index_best_fit - return the smallest indexed block of at least size
+ *     bytes, the first one in list order if several are, or NULL if there is
+ *     none. Adds the number of blocks a walk of the list would have looked
+ *     at, which stops early only at an exact fit, to searched.
+ */
+block_t *size_index_best_fit(size_index_t *idx, char *base, long size,
+                             long *searched) {
+    uint32_t need = (uint32_t)(size / ALIGNMENT);
+    uint32_t *sizes = idx->sizes + idx->first;
+    const kernels_t *k = get_kernels();
+    int i;
+
+    if (idx->live == 0 ||
+        (i = k->best_ge(sizes, idx->capacity - idx->first, need)) < 0) {
+        *searched += idx->live;
+        return NULL;
+    }
+    if (sizes[i] == need) {
+        *searched += i + 1 - k->count_eq(sizes, i, 0);
+    } else {
+        *searched += idx->live;
+    }
+    return entry_block(idx, base, idx->first + i);
+}
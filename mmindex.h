@@ -0,0 +1,54 @@
+#ifndef MMINDEX_H_
+#define MMINDEX_H_
+
+#include <stdint.h>
+
+#include "mm.h"
+
+/*
+ * A size index is a search accelerator kept next to one intrusive free list.
+ * It packs the size and position of every block on the list into two
+ * contiguous arrays, so that a fit search scans 4 to 8 sizes per SIMD compare
+ * instead of following one flink (and taking one cache miss) per block.
+ * Sizes and offsets are stored in units of ALIGNMENT, offsets relative to a
+ * base address chosen by the caller (e.g. the start of the heap), so an index
+ * can only hold blocks within SIZE_INDEX_SPAN bytes of its base.
+ *
+ * The entries are kept in the order of the list, which puts new blocks at its
+ * head: each one is stored in front of the others, and a removed one is only
+ * marked with size 0 until the arrays are compacted. A search therefore picks
+ * the very block a walk of the list would, and reports how many list blocks
+ * that walk would have looked at. A hash table of offsets finds the entry of
+ * a block that is removed in constant time.
+ *
+ * A block missing from the index (because growing the arrays failed) is
+ * never returned by a search, which costs space but not correctness.
+ */
+#define SIZE_INDEX_SPAN ((long)UINT32_MAX * ALIGNMENT)
+
+typedef struct {
+    uint32_t *sizes;    // block sizes / ALIGNMENT, 0 once removed
+    uint32_t *offsets;  // (block - base) / ALIGNMENT
+    int first;          // the entries are [first, capacity), newest first
+    int capacity;       // entries allocated
+    int live;           // entries not removed
+    int *slots;         // hash table of entry + 1 by offset; 0 is empty
+    int num_slots;      // its size, a power of two above capacity
+} size_index_t;
+
+void size_index_init(size_index_t *idx);
+void size_index_destroy(size_index_t *idx);
+void size_index_clear(size_index_t *idx);
+int size_index_copy(size_index_t *dst, const size_index_t *src);
+void size_index_insert(size_index_t *idx, char *base, block_t *b);
+void size_index_remove(size_index_t *idx, char *base, block_t *b);
+block_t *size_index_first_fit(size_index_t *idx, char *base, long size,
+                              long *searched);
+block_t *size_index_best_fit(size_index_t *idx, char *base, long size,
+                             long *searched);
+
+/* the scan kernels in use: "avx2", "sse4.1" or "scalar" */
+const char *size_index_isa(void);
+int size_index_set_isa(const char *isa);
+
+#endif  // MMINDEX_H_
@@ -1,9 +1,30 @@
 #ifndef MMINLINE_H_
 #define MMINLINE_H_
 #include "mm.h"
+#include "mmcache.h"
 #include <assert.h>
 
-static block_t *flist_first;  // head of circular, doubly linked free list
+/*
+ * When MM_FOOTERS is 0 (see mm.h), allocated blocks have no end tag and their
+ * payload runs up to the next block. Instead, every header records whether
+ * the previous block is allocated in the PREV_ALLOCATED bit, and only free
+ * blocks keep a copy of their size in an end tag. block_prev may then only be
+ * used on a block whose previous block is free.
+ */
+#define PREV_ALLOCATED 2
+// the bits of a tag that hold flags rather than size
+#define TAG_FLAGS (ALIGNMENT - 1)
+
+/*
+ * In the cache simulation build (MM_CACHE_SIM, see mmcache.h), the helpers
+ * below report every tag and link they read or write; otherwise these are
+ * nothing.
+ */
+#define touch_header(b) mm_cache_touch(&(b)->size, WORD_SIZE, MM_CACHE_HEADER)
+#define touch_footer(tag) mm_cache_touch((tag), WORD_SIZE, MM_CACHE_FOOTER)
+#define touch_link(link) mm_cache_touch((link), WORD_SIZE, MM_CACHE_LINK)
+
+static block_t *flist_first;  // head of the list used by insert/pull_free_block
 extern block_t *prologue;
 extern block_t *epilogue;
 
@@ -25,6 +46,7 @@ extern block_t *epilogue;
  */
 static inline int block_allocated(block_t *b) { 
     // TODO: Implement this function!
+    touch_header(b);
     return b->size & 1;
 }
 
@@ -52,16 +74,29 @@ static inline long *block_end_tag(block_t *b) {
  */
 static inline int block_end_allocated(block_t *b) {
     // TODO: Implement this function!
+    touch_footer(block_end_tag(b));
     return *block_end_tag(b) & 1;
 }
 
+/*
+ * |_ | _  _.;_/     _ ._  _|     __*__. _
+ * [_)|(_)(_.| \____(/,[ )(_]_____) | /_(/,
+ *
+ * returns whether the block has an end tag: always, unless footers are elided,
+ * in which case only free blocks have one
+ */
+static inline int block_has_end_tag(block_t *b) {
+    return MM_FOOTERS || !block_allocated(b);
+}
+
 /*
  * |_ | _  _.;_/     __ _ -+-     __*__. _
  * [_)|(_)(_.| \_____) (/, | _____) | /_(/,
  *
  * Sets the entire size of the block at both the beginning and the end tags
  * Preserves the alloc bit (if b is marked allocated or free, it will remain
- * so).
+ * so), and the PREV_ALLOCATED bit when footers are elided. Allocated blocks
+ * without footers only get the beginning tag, since their end is payload.
  * NOTE: size must be a multiple of ALIGNMENT, which means that in binary, its
  * right-most 3 bits must be 0. Thus, we can check if size is a multiple of
  * ALIGNMENT by &-ing it with ALIGNMENT - 1, which is 00..00111 in binary if
@@ -72,8 +107,15 @@ static inline void block_set_size(block_t *b, long size) {
     assert((size & (ALIGNMENT - 1)) == 0);
     // TODO: Implement this function
     size |= block_allocated(b);
+    if (!MM_FOOTERS) {
+        size |= b->size & PREV_ALLOCATED;
+    }
+    touch_header(b);
     b->size = size;
-    *block_end_tag(b) = size;
+    if (block_has_end_tag(b)) {
+        touch_footer(block_end_tag(b));
+        *block_end_tag(b) = size;
+    }
 }
 
 /*
@@ -82,11 +124,12 @@ static inline void block_set_size(block_t *b, long size) {
  *
  * returns the size of the entire block
  * NOTE: Think about how to use & to remove the is-allocated bit
- * from the size
+ * (and any other flag in TAG_FLAGS) from the size
  */
 static inline long block_size(block_t *b) { 
     // TODO: Implement this function!
-    return b->size & -2;
+    touch_header(b);
+    return b->size & ~TAG_FLAGS;
 }
 
 /**
@@ -100,10 +143,29 @@ static inline long block_size(block_t *b) {
  * 
  * Sets the allocated flags of the block, at both the beginning and the end
  * tags. NOTE: -2 is 111...1110 in binary
+ * When footers are elided, a block that becomes free gets a fresh end tag,
+ * and the next block's PREV_ALLOCATED bit is updated, so the next block must
+ * have a beginning tag in memory that is part of the heap.
  */
 static inline void block_set_allocated(block_t *b, int allocated) {
     assert((allocated == 0) || (allocated == 1));
     // TODO: Implement this function
+    touch_header(b);
+    if (!MM_FOOTERS) {
+        block_t *next = (block_t *)((char *)b + (b->size & ~TAG_FLAGS));
+        touch_header(next);
+        if (allocated) {
+            b->size |= 1;
+            next->size |= PREV_ALLOCATED;
+        } else {
+            b->size &= -2;
+            touch_footer(block_end_tag(b));
+            *block_end_tag(b) = b->size;
+            next->size &= ~(long)PREV_ALLOCATED;
+        }
+        return;
+    }
+    touch_footer(block_end_tag(b));
     if (allocated){
         b->size |= 1;
         *block_end_tag(b) |= 1;
@@ -145,7 +207,8 @@ static inline void block_set_size_and_allocated(block_t *b, long size,
  */
 static inline long block_end_size(block_t *b) {
     // TODO: Implement this function!
-    return *block_end_tag(b) & -2;
+    touch_footer(block_end_tag(b));
+    return *block_end_tag(b) & ~TAG_FLAGS;
 }
 
 /**
@@ -158,11 +221,12 @@ static inline long block_end_size(block_t *b) {
  * [_)|(_)(_.| \___[_)[  (/, \/ ___) | /_(/,
  *                  |
  * 
- * returns the size of the previous block. NOTE: -2 is 111...1110 in binary
+ * returns the size of the previous block, read from its end tag
  */
 static inline long block_prev_size(block_t *b) {
     // TODO: Implement this function
-    return b->payload[-2] & -2;
+    touch_footer(&b->payload[-2]);
+    return b->payload[-2] & ~TAG_FLAGS;
 }
 
 /*
@@ -252,9 +316,35 @@ static inline long block_next_size(block_t *b) {
  */
 static inline int block_prev_allocated(block_t *b) {
     // TODO: Implement this function
+    if (!MM_FOOTERS) {
+        touch_header(b);
+        return (b->size & PREV_ALLOCATED) != 0;
+    }
     return block_allocated(block_prev(b));
 }
 
+/*
+ * |_ | _  _.;_/    *._ *-+-
+ * [_)|(_)(_.| \____|[ )| |
+ *
+ * writes a fresh beginning tag (and, if the block needs one, end tag) for a
+ * block whose memory holds no tags yet, such as the prologue and epilogue.
+ * Unlike block_set_allocated, neighbouring blocks are left untouched.
+ */
+static inline void block_init(block_t *b, long size, int allocated,
+                              int prev_allocated) {
+    assert((size & TAG_FLAGS) == 0);
+    touch_header(b);
+    b->size = size | allocated;
+    if (!MM_FOOTERS && prev_allocated) {
+        b->size |= PREV_ALLOCATED;
+    }
+    if (block_has_end_tag(b)) {
+        touch_footer(block_end_tag(b));
+        *block_end_tag(b) = b->size;
+    }
+}
+
 /**
  * If all functions previous to this line are complete, prev_size_and_allocated
  * test will pass
@@ -271,7 +361,12 @@ static inline int block_prev_allocated(block_t *b) {
 static inline block_t *block_blink(block_t *b) {
     assert(!block_allocated(b));
     // TODO: Implement this function
+    touch_link(&b->payload[1]);
+#if MM_OFFSETS
+    return (block_t *)((char *)b + b->payload[1]);
+#else
     return (block_t *)b->payload[1];
+#endif
 }
 
 /*
@@ -284,7 +379,12 @@ static inline block_t *block_blink(block_t *b) {
 static inline void block_set_blink(block_t *b, block_t *new_blink) {
     assert(!block_allocated(b) && !block_allocated(new_blink));
     // TODO: Implement this function
+    touch_link(&b->payload[1]);
+#if MM_OFFSETS
+    b->payload[1] = (char *)new_blink - (char *)b;
+#else
     b->payload[1] = (size_t)new_blink;
+#endif
 }
 
 /**
@@ -302,7 +402,12 @@ static inline void block_set_blink(block_t *b, block_t *new_blink) {
 static inline block_t *block_flink(block_t *b) {
     assert(!block_allocated(b));
     // TODO: Implement this function
+    touch_link(&b->payload[0]);
+#if MM_OFFSETS
+    return (block_t *)((char *)b + b->payload[0]);
+#else
     return (block_t *)b->payload[0];
+#endif
 }
 
 /*
@@ -316,7 +421,12 @@ static inline block_t *block_flink(block_t *b) {
 static inline void block_set_flink(block_t *b, block_t *new_flink) {
     assert(!block_allocated(b) && !block_allocated(new_flink));
     // TODO: Implement this function
+    touch_link(&b->payload[0]);
+#if MM_OFFSETS
+    b->payload[0] = (char *)new_flink - (char *)b;
+#else
     b->payload[0] = (size_t)new_flink;
+#endif
 }
 
 /**
@@ -329,26 +439,31 @@ static inline void block_set_flink(block_t *b, block_t *new_flink) {
  * . _  __ _ ._.-+-    |,._. _  _     |_ | _  _.;_/
  * |[ )_) (/,[   | ____| [  (/,(/,____[_)|(_)(_.| \
  * 
- * insert block into the (circularly doubly linked) free list
- * If the list is not empty, block should be inserted between
- * flist_first and the last block in the list. flist_first 
- * should always be set equal to the new block.
+ * insert block into the (circularly doubly linked) free list whose first
+ * block is *head. If the list is not empty, block should be inserted between
+ * *head and the last block in the list. *head should always be set equal to
+ * the new block.
  */
-static inline void insert_free_block(block_t *fb) {
+static inline void flist_insert(block_t **head, block_t *fb) {
     assert(!block_allocated(fb));
-    // TODO: Implement this function
-    if (flist_first != NULL){
-        block_t *last = block_blink(flist_first);
-        block_set_flink(fb, flist_first);
+    if (*head != NULL) {
+        block_t *last = block_blink(*head);
+        block_set_flink(fb, *head);
         block_set_blink(fb, last);
         block_set_flink(last, fb);
-        block_set_blink(flist_first, fb);
-    }else{
+        block_set_blink(*head, fb);
+    } else {
         block_set_flink(fb, fb);
         block_set_blink(fb, fb);
     }
-    flist_first = fb;
+    *head = fb;
+}
 
+/*
+ * same as flist_insert, on the list headed by flist_first
+ */
+static inline void insert_free_block(block_t *fb) {
+    flist_insert(&flist_first, fb);
 }
 
 /**
@@ -361,19 +476,26 @@ static inline void insert_free_block(block_t *fb) {
  * [_)(_|||____| [  (/,(/,____[_)|(_)(_.| \
  * |
  * 
- * pull a block from the (circularly doubly linked) free list
+ * pull a block from the (circularly doubly linked) free list whose first
+ * block is *head
  */
-static inline void pull_free_block(block_t *fb) {
+static inline void flist_pull(block_t **head, block_t *fb) {
     assert(!block_allocated(fb));
-    // TODO: Implement this function
-    if (flist_first == fb) {
-    if ((flist_first = block_flink(fb)) == fb) {
-      flist_first = NULL;
-      return;
+    if (*head == fb) {
+        if ((*head = block_flink(fb)) == fb) {
+            *head = NULL;
+            return;
+        }
     }
-  }
-  block_set_flink(block_blink(fb), block_flink(fb));
-  block_set_blink(block_flink(fb), block_blink(fb));
+    block_set_flink(block_blink(fb), block_flink(fb));
+    block_set_blink(block_flink(fb), block_blink(fb));
+}
+
+/*
+ * same as flist_pull, on the list headed by flist_first
+ */
+static inline void pull_free_block(block_t *fb) {
+    flist_pull(&flist_first, fb);
 }
 
 /**
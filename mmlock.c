@@ -0,0 +1,138 @@
+/*
+ * mmlock.c - the lock profiler behind -D MM_LOCK_PROFILE=1. See mmlock.h.
+ *            Each thread counts into a block of its own. The block of a
+ *            thread that exits is kept, and handed to the next new thread,
+ *            so its counts still show up in the report.
+ */
+#include "mmlock.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOCK_SLOTS 32  // distinct lock names; the last slot takes the rest
+
+/* one thread's counts, one slot per lock name */
+typedef struct thread_stats {
+    mm_lock_stats_t slots[LOCK_SLOTS];
+    int in_use;                 // whether a live thread owns the block
+    struct thread_stats *next;  // every block ever handed out
+} thread_stats_t;
+
+__thread mm_lock_stats_t *mm_lock_tls;
+
+// guards everything below; only taken on registration and for reports
+static pthread_mutex_t registry = PTHREAD_MUTEX_INITIALIZER;
+static const char *names[LOCK_SLOTS];
+static int num_names;
+static thread_stats_t *all_stats;
+static pthread_key_t stats_key;  // its destructor gives a block back
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+
+static void release_stats(void *arg) {
+    pthread_mutex_lock(&registry);
+    ((thread_stats_t *)arg)->in_use = 0;
+    pthread_mutex_unlock(&registry);
+}
+
+static void stats_key_create(void) {
+    pthread_key_create(&stats_key, release_stats);
+}
+
+/*
+ * mm_lock_slot - return the index of the counts for locks of the given name,
+ *     registering the name if it is new
+ */
+int mm_lock_slot(const char *name) {
+    int slot;
+
+    pthread_mutex_lock(&registry);
+    for (slot = 0; slot < num_names; slot++) {
+        if (!strcmp(names[slot], name)) {
+            break;
+        }
+    }
+    if (slot == LOCK_SLOTS) {
+        slot = LOCK_SLOTS - 1;  // full: counted under "(other)"
+    } else if (slot == num_names) {
+        names[num_names++] = (slot == LOCK_SLOTS - 1) ? "(other)" : name;
+    }
+    pthread_mutex_unlock(&registry);
+    return slot;
+}
+
+/*
+ * mm_lock_thread_stats - return the calling thread's counts, finding it a
+ *     block on its first call. Exits if there is no memory for one.
+ */
+mm_lock_stats_t *mm_lock_thread_stats(void) {
+    thread_stats_t *block;
+
+    if (mm_lock_tls != NULL) {
+        return mm_lock_tls;
+    }
+    pthread_once(&stats_key_once, stats_key_create);
+    pthread_mutex_lock(&registry);
+    block = all_stats;
+    while (block != NULL && block->in_use) {
+        block = block->next;
+    }
+    if (block == NULL) {
+        if ((block = calloc(1, sizeof(thread_stats_t))) == NULL) {
+            fprintf(stderr, "mm_lock_thread_stats: out of memory\n");
+            exit(1);
+        }
+        block->next = all_stats;
+        all_stats = block;
+    }
+    block->in_use = 1;
+    pthread_mutex_unlock(&registry);
+    pthread_setspecific(stats_key, block);
+    mm_lock_tls = block->slots;
+    return mm_lock_tls;
+}
+
+/*
+ * mm_lock_report - merge the counts of every thread and print one line per
+ *     lock name that was taken. Prints nothing if no lock is profiled.
+ */
+void mm_lock_report(FILE *out) {
+    pthread_mutex_lock(&registry);
+    if (num_names > 0) {
+        fprintf(out, "%-12s %10s %10s %7s %10s %10s %12s\n", "lock", "acquires",
+                "contended", "%", "wait ms", "avg wait", "max hold");
+    }
+    for (int slot = 0; slot < num_names; slot++) {
+        mm_lock_stats_t sum = {0, 0, 0, 0};
+        for (thread_stats_t *b = all_stats; b != NULL; b = b->next) {
+            mm_lock_stats_t *s = &b->slots[slot];
+            sum.acquires += s->acquires;
+            sum.contended += s->contended;
+            sum.wait_ns += s->wait_ns;
+            if (s->max_hold_ns > sum.max_hold_ns) {
+                sum.max_hold_ns = s->max_hold_ns;
+            }
+        }
+        if (sum.acquires == 0) {
+            continue;
+        }
+        fprintf(out, "%-12s %10ld %10ld %6.2f%% %10.3f %8ldns %10ldns\n",
+                names[slot], sum.acquires, sum.contended,
+                100.0 * sum.contended / sum.acquires, sum.wait_ns / 1e6,
+                sum.contended ? sum.wait_ns / sum.contended : 0,
+                sum.max_hold_ns);
+    }
+    pthread_mutex_unlock(&registry);
+}
+
+/*
+ * mm_lock_reset - zero the counts of every thread. Must not race with
+ *     threads that take profiled locks.
+ */
+void mm_lock_reset(void) {
+    pthread_mutex_lock(&registry);
+    for (thread_stats_t *b = all_stats; b != NULL; b = b->next) {
+        memset(b->slots, 0, sizeof(b->slots));
+    }
+    pthread_mutex_unlock(&registry);
+}
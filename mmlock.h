@@ -0,0 +1,222 @@
+#ifndef MMLOCK_H_
+#define MMLOCK_H_
+
+#include <stdio.h>
+
+/*
+ * The lock that makes a heap safe to share between threads. Every public
+ * mm_heap_* call holds its heap's lock for the whole operation. The kind of
+ * lock is chosen at compile time with -D MM_LOCK=<n>, so that other schemes
+ * can be compared against the same allocator. mm_lock_try takes the lock only
+ * if that needs no waiting and returns whether it did. Every lock has a name,
+ * which only the profiler below uses. A raw lock set up with
+ * raw_lock_init_shared in memory that several processes map works across
+ * them (not with MM_LOCK 0, which has nothing to share).
+ *
+ * MM_LOCK  0: no lock, for single-threaded use only
+ *          1: pthread mutex (default)
+ *          2: spinlock (test and test-and-set), yielding the CPU after
+ *             SPIN_TRIES failed tries
+ *
+ * With -D MM_LOCK_PROFILE=1, every lock also counts how often it was taken,
+ * how often that meant waiting, how long was spent waiting, and the longest
+ * time it was held. The counts are kept per thread, with no atomics, and
+ * merged by name in mm_lock_report, so e.g. the locks of all heaps add up
+ * under "heap". Without it (the default), locks are the bare lock kind.
+ */
+#define MM_LOCK_NONE 0
+#define MM_LOCK_MUTEX 1
+#define MM_LOCK_SPIN 2
+#ifndef MM_LOCK
+#define MM_LOCK MM_LOCK_MUTEX
+#endif
+#ifndef MM_LOCK_PROFILE
+#define MM_LOCK_PROFILE 0
+#endif
+
+#if MM_LOCK == MM_LOCK_MUTEX
+#include <pthread.h>
+
+typedef pthread_mutex_t mm_raw_lock_t;
+#define MM_RAW_LOCK_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+
+static inline void raw_lock_init(mm_raw_lock_t *lock) {
+    pthread_mutex_init(lock, NULL);
+}
+static inline void raw_lock_init_shared(mm_raw_lock_t *lock) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+static inline void raw_lock_destroy(mm_raw_lock_t *lock) {
+    pthread_mutex_destroy(lock);
+}
+static inline void raw_lock_acquire(mm_raw_lock_t *lock) {
+    pthread_mutex_lock(lock);
+}
+static inline void raw_lock_release(mm_raw_lock_t *lock) {
+    pthread_mutex_unlock(lock);
+}
+static inline int raw_lock_try(mm_raw_lock_t *lock) {
+    return pthread_mutex_trylock(lock) == 0;
+}
+
+#elif MM_LOCK == MM_LOCK_SPIN
+#include <sched.h>
+
+#define SPIN_TRIES 64  // failed tries before giving up the CPU
+
+typedef struct {
+    int held;
+} mm_raw_lock_t;
+#define MM_RAW_LOCK_INITIALIZER \
+    { 0 }
+
+static inline void raw_lock_init(mm_raw_lock_t *lock) { lock->held = 0; }
+static inline void raw_lock_init_shared(mm_raw_lock_t *lock) {
+    lock->held = 0;  // atomics work across processes as they are
+}
+static inline void raw_lock_destroy(mm_raw_lock_t *lock) { (void)lock; }
+static inline void raw_lock_acquire(mm_raw_lock_t *lock) {
+    int tries = 0;
+    while (__atomic_exchange_n(&lock->held, 1, __ATOMIC_ACQUIRE)) {
+        // wait with plain loads so the cache line is not bounced around
+        while (__atomic_load_n(&lock->held, __ATOMIC_RELAXED)) {
+            if (++tries == SPIN_TRIES) {
+                tries = 0;
+                sched_yield();
+            }
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+        }
+    }
+}
+static inline void raw_lock_release(mm_raw_lock_t *lock) {
+    __atomic_store_n(&lock->held, 0, __ATOMIC_RELEASE);
+}
+static inline int raw_lock_try(mm_raw_lock_t *lock) {
+    return !__atomic_load_n(&lock->held, __ATOMIC_RELAXED) &&
+           !__atomic_exchange_n(&lock->held, 1, __ATOMIC_ACQUIRE);
+}
+
+#else
+typedef struct {
+    char unused;  // C does not allow empty structs
+} mm_raw_lock_t;
+#define MM_RAW_LOCK_INITIALIZER \
+    { 0 }
+
+static inline void raw_lock_init(mm_raw_lock_t *lock) { (void)lock; }
+static inline void raw_lock_init_shared(mm_raw_lock_t *lock) { (void)lock; }
+static inline void raw_lock_destroy(mm_raw_lock_t *lock) { (void)lock; }
+static inline void raw_lock_acquire(mm_raw_lock_t *lock) { (void)lock; }
+static inline void raw_lock_release(mm_raw_lock_t *lock) { (void)lock; }
+static inline int raw_lock_try(mm_raw_lock_t *lock) {
+    (void)lock;
+    return 1;
+}
+#endif
+
+/* what one thread saw of the locks of one name */
+typedef struct {
+    long acquires;     // times a lock was taken
+    long contended;    // ... of which it first had to be waited for
+    long wait_ns;      // total time spent waiting
+    long max_hold_ns;  // longest time a lock was held
+} mm_lock_stats_t;
+
+/*
+ * the profiler, in mmlock.c. It is linked into every build, but with
+ * MM_LOCK_PROFILE off no lock ever registers and the report is empty.
+ */
+int mm_lock_slot(const char *name);
+mm_lock_stats_t *mm_lock_thread_stats(void);
+void mm_lock_report(FILE *out);
+void mm_lock_reset(void);
+
+#if MM_LOCK_PROFILE
+#include <time.h>
+
+extern __thread mm_lock_stats_t *mm_lock_tls;  // the calling thread's counts
+
+typedef struct {
+    mm_raw_lock_t raw;
+    const char *name;
+    int slot;         // the name's index in the counts, -1 until looked up
+    long held_since;  // when the holder took the lock, in ns
+} mm_lock_t;
+#define MM_LOCK_INITIALIZER(name) \
+    { MM_RAW_LOCK_INITIALIZER, name, -1, 0 }
+
+static inline long lock_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// returns the calling thread's counts for the lock
+static inline mm_lock_stats_t *lock_stats(mm_lock_t *lock) {
+    // statically initialized locks look their slot up on first use; racing
+    // threads all find and store the same one
+    int slot = __atomic_load_n(&lock->slot, __ATOMIC_RELAXED);
+    if (slot < 0) {
+        slot = mm_lock_slot(lock->name);
+        __atomic_store_n(&lock->slot, slot, __ATOMIC_RELAXED);
+    }
+    return (mm_lock_tls ? mm_lock_tls : mm_lock_thread_stats()) + slot;
+}
+
+static inline void mm_lock_init(mm_lock_t *lock, const char *name) {
+    raw_lock_init(&lock->raw);
+    lock->name = name;
+    lock->slot = mm_lock_slot(name);
+}
+static inline void mm_lock_destroy(mm_lock_t *lock) {
+    raw_lock_destroy(&lock->raw);
+}
+static inline void mm_lock_acquire(mm_lock_t *lock) {
+    mm_lock_stats_t *stats = lock_stats(lock);
+    if (!raw_lock_try(&lock->raw)) {
+        long start = lock_now_ns();
+        raw_lock_acquire(&lock->raw);
+        stats->contended++;
+        stats->wait_ns += lock_now_ns() - start;
+    }
+    stats->acquires++;
+    lock->held_since = lock_now_ns();
+}
+static inline void mm_lock_release(mm_lock_t *lock) {
+    mm_lock_stats_t *stats = lock_stats(lock);
+    long held = lock_now_ns() - lock->held_since;
+    if (held > stats->max_hold_ns) {
+        stats->max_hold_ns = held;
+    }
+    raw_lock_release(&lock->raw);
+}
+static inline int mm_lock_try(mm_lock_t *lock) {
+    if (!raw_lock_try(&lock->raw)) {
+        return 0;
+    }
+    lock_stats(lock)->acquires++;
+    lock->held_since = lock_now_ns();
+    return 1;
+}
+
+#else
+typedef mm_raw_lock_t mm_lock_t;
+#define MM_LOCK_INITIALIZER(name) MM_RAW_LOCK_INITIALIZER
+
+static inline void mm_lock_init(mm_lock_t *lock, const char *name) {
+    (void)name;
+    raw_lock_init(lock);
+}
+static inline void mm_lock_destroy(mm_lock_t *lock) { raw_lock_destroy(lock); }
+static inline void mm_lock_acquire(mm_lock_t *lock) { raw_lock_acquire(lock); }
+static inline void mm_lock_release(mm_lock_t *lock) { raw_lock_release(lock); }
+static inline int mm_lock_try(mm_lock_t *lock) { return raw_lock_try(lock); }
+#endif
+
+#endif  // MMLOCK_H_
@@ -10,6 +10,8 @@ use Getopt::Std;
 #
 # This script reads a Malloc Lab trace file, checks it for consistency,
 # and outputs a balanced version by appending any necessary free requests.
+# In multi-threaded traces (see README) it also checks that exactly the
+# requests on a block last touched by another thread carry a ^ marker.
 #
 #######################################################################
 
@@ -49,6 +51,13 @@ $summary = $opt_s;
 #
 %HASH = ();
 
+#
+# OWNER holds the thread of the latest request on each id, and THREADS
+# the number of threads seen (0 if no line names one).
+#
+%OWNER = ();
+$threads = 0;
+
 # Read the trace header values
 $heap_size = <STDIN>;
 chomp($heap_size);
@@ -71,13 +80,34 @@ while ($line = <STDIN>) {
     chomp($line);
     $linenum++;
 
-    ($cmd, $id, $size) = split(" ", $line);
+    @fields = split(" ", $line);
 
     # ignore blank lines
-    if (!$cmd) {
+    if (!@fields) {
 	next;
     }
 
+    # an optional leading thread id, and an optional ^ marker on the command
+    $thread = 0;
+    if ($fields[0] =~ /^\d+$/) {
+	$thread = shift(@fields);
+	$threads = $thread + 1 if ($thread + 1 > $threads);
+    }
+    ($cmd, $id, $size) = @fields;
+    $wait = ($cmd =~ s/\^$//);
+
+    if ($cmd ne "a" and $cmd ne "r" and $cmd ne "f") {
+	die "$0: ERROR[$linenum]: bad request.\n";
+    }
+    $cross = (exists($OWNER{$id}) and $OWNER{$id} != $thread);
+    if ($cross and !$wait) {
+	die "$0: ERROR[$linenum]: request on a block of thread $OWNER{$id} without ^ marker.\n";
+    }
+    if ($wait and !$cross) {
+	die "$0: ERROR[$linenum]: needless ^ marker.\n";
+    }
+    $OWNER{$id} = $thread;
+
     # save the line for output later
     $lines[$requestnum++] = $line;
 
@@ -119,7 +149,10 @@ while ($line = <STDIN>) {
 # If called with -s argument , print a brief balance summary and exit
 #
 if ($summary) {
-    if (!%HASH) {
+    if (!%HASH and $threads) {
+	print "Balanced trace, $threads threads.\n";
+    }
+    elsif (!%HASH) {
 	print "Balanced trace.\n";
     }
     else {
@@ -149,6 +182,10 @@ foreach $key (sort keys %HASH) {
     if ($HASH{$key} ne "a" and $HASH{$key} ne "r") {
 	die "$0: ERROR: Invalid free request in residue.\n";
     }
+    # on the thread that touched the block last, so no marker is needed
+    if ($threads) {
+	print "$OWNER{$key} ";
+    }
     print "f $key\n";
 }
 
@@ -0,0 +1,50 @@
+#!/usr/bin/perl
+#!/usr/local/bin/perl
+
+$out_filename = "prodcons.rep";
+$num_pairs = 2;
+$num_iters = 2000;
+$lag = 32;
+
+# Open output file
+open OUTFILE, ">$out_filename" or die "Cannot create $out_filename\n";
+
+# Calculate misc parameters. Thread 2p allocates the blocks of pair p and
+# thread 2p+1 frees them $lag iterations later, growing every 8th one
+# with a realloc first. The last $lag blocks of each pair are left for
+# checktrace.pl to free.
+$num_blocks = $num_pairs*$num_iters;
+$num_reallocs = 0;
+for ($i = 0; $i < $num_iters - $lag; $i += 1) {
+    $num_reallocs += ($i % 8 == 0) ? $num_pairs : 0;
+}
+$num_ops = $num_blocks + $num_pairs*($num_iters - $lag) + $num_reallocs;
+$suggested_heap_size = $num_pairs*$lag*1024 + 100;
+
+print OUTFILE "$suggested_heap_size\n";
+print OUTFILE "$num_blocks\n";
+print OUTFILE "$num_ops\n";
+print OUTFILE "1\n";
+
+for ($i = 0; $i < $num_iters; $i += 1) {
+    for ($p = 0; $p < $num_pairs; $p += 1) {
+        $producer = 2*$p;
+        $consumer = 2*$p + 1;
+        $id = $i*$num_pairs + $p;
+        $size = 16 + ($i*37 + $p*101) % 496;
+        print OUTFILE "$producer a $id $size\n";
+        if ($i >= $lag) {
+            $old = ($i - $lag)*$num_pairs + $p;
+            if (($i - $lag) % 8 == 0) {
+                $new_size = 2*(16 + (($i - $lag)*37 + $p*101) % 496);
+                print OUTFILE "$consumer r^ $old $new_size\n";
+                print OUTFILE "$consumer f $old\n";
+            }
+            else {
+                print OUTFILE "$consumer f^ $old\n";
+            }
+        }
+    }
+}
+
+close OUTFILE;